@@ -0,0 +1,82 @@
+#include <new>
+#include <algorithm>
+#include "arena.hpp"
+
+/* ARENA CLASS */
+Arena::Arena(size_t block) : block_size(block), offset(0), bytes_used(0) {}
+
+Arena::~Arena() {
+    clear();
+}
+
+// Make an object in the arena. It lives until the arena is cleared.
+template <typename T, typename... Args>
+T *Arena::create(Args&&... args) {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "Arena blocks are only aligned for fundamental types");
+    T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    objects.push_back(std::make_pair(static_cast<void*>(object), &Arena::destroy<T>));
+    return object;
+}
+
+template <typename T>
+void Arena::destroy(void *object) {
+    static_cast<T*>(object)->~T();
+}
+
+// Room for size bytes at the given alignment, from the last block or a new
+// one. Objects larger than a block get a block of their own, placed before
+// the last so its free space is still used.
+void *Arena::allocate(size_t size, size_t alignment) {
+    if (size > block_size) {
+        char *block = new char[size];
+        if (blocks.empty()) {
+            // The only block, and full
+            blocks.push_back(std::make_pair(block, size));
+            offset = size;
+        } else {
+            blocks.insert(blocks.end() - 1, std::make_pair(block, size));
+        }
+        bytes_used += size;
+        return block;
+    }
+
+    size_t start = (offset + alignment - 1) / alignment * alignment;
+    if (blocks.empty() || start + size > blocks.back().second) {
+        blocks.push_back(std::make_pair(new char[block_size], block_size));
+        start = offset = 0;
+    }
+
+    bytes_used += (start - offset) + size;
+    offset = start + size;
+    return blocks.back().first + start;
+}
+
+void Arena::clear() {
+    for (auto o = objects.rbegin(); o != objects.rend(); o++) {
+        o->second(o->first);
+    }
+    for (auto &block : blocks) {
+        delete[] block.first;
+    }
+
+    objects.clear();
+    blocks.clear();
+    offset = 0;
+    bytes_used = 0;
+}
+
+size_t Arena::used() const {
+    return bytes_used;
+}
+
+size_t Arena::reserved() const {
+    size_t bytes = 0;
+    for (auto &block : blocks) {
+        bytes += block.second;
+    }
+    return bytes;
+}
+
+int Arena::count() const {
+    return objects.size();
+}
@@ -0,0 +1,49 @@
+#ifndef __ARENA_HPP__
+#define __ARENA_HPP__
+
+#include <cstddef>
+#include <vector>
+#include <utility>
+
+// Objects are packed into blocks of this many bytes, larger ones get their own
+const size_t ARENA_BLOCK_BYTES = 64 * 1024;
+
+// Holds a scene's objects and lights one after another in the order they are
+// made, so traversal touches neighbouring memory and the whole scene is
+// freed at once. Objects are never freed one by one: clear destroys them all,
+// last made first, and releases the blocks.
+class Arena {
+public:
+
+    Arena(size_t block = ARENA_BLOCK_BYTES);
+    ~Arena();
+
+    template <typename T, typename... Args>
+    T *create(Args&&... args);
+
+    void clear();
+    size_t used() const; // Bytes taken by objects, with their alignment padding
+    size_t reserved() const; // Bytes in blocks
+    int count() const;
+
+private:
+
+    size_t block_size;
+    std::vector<std::pair<char*, size_t>> blocks; // Start and size of each block
+    size_t offset; // Bytes taken in the last block
+    size_t bytes_used;
+    std::vector<std::pair<void*, void (*)(void*)>> objects; // Each object and its destructor
+
+    void *allocate(size_t size, size_t alignment);
+
+    template <typename T>
+    static void destroy(void *object);
+
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+};
+
+#include "arena.cpp"
+
+#endif
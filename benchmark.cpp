@@ -0,0 +1,229 @@
+// Times rendering of the shipped levels from fixed camera poses and writes the
+// results as JSON, to track performance across builds:
+//
+//   benchmark [levels...] [--iterations=N] [--warmup=N] [--output=file.json]
+//             [renderer options]
+//
+// Without levels it renders 1 to 4 and the scene.json in the working
+// directory. Each level is rendered from where its camera starts and turned
+// to the side, at preview and full resolution. Levels that fail to load are
+// skipped and listed in the results. Progress goes to stderr and the JSON to
+// stdout unless --output is given.
+
+#define cimg_display 0
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <glm/vec3.hpp>
+#include <glm/geometric.hpp>
+
+#include "raytrace.hpp"
+#include "level.hpp"
+
+const int BENCHMARK_WIDTH = 640, BENCHMARK_HEIGHT = 480;
+const int BENCHMARK_PREVIEW_WIDTH = 160, BENCHMARK_PREVIEW_HEIGHT = 120;
+
+// A view of a level, turned from the camera's starting direction about the
+// vertical axis
+class BenchmarkPose {
+public:
+
+    const char *name;
+    float turn; // Radians, to the right
+
+};
+
+const BenchmarkPose BENCHMARK_POSES[] = {{"start", 0.0}, {"turned", M_PI / 4.0}};
+
+// Timings of one level, pose and resolution
+class BenchmarkResult {
+public:
+
+    std::string level;
+    std::string pose;
+    bool preview;
+    int width, height;
+    int AA;
+    std::string accelerator;
+    bool packets;
+    int threads;
+    long primary_rays; // Per frame
+    std::vector<double> ms; // Each timed frame, sorted
+    double render_seconds; // Summed over the timed frames, without tone mapping
+    TraversalStats traversal; // Of the last frame
+
+};
+
+// Value below which p percent of the sorted samples fall, by nearest rank
+static double percentile(const std::vector<double>& sorted, double p) {
+    int rank = (int) std::ceil(p / 100.0 * sorted.size());
+    return sorted[std::min(std::max(rank, 1), (int) sorted.size()) - 1];
+}
+
+// Render a view repeatedly, timing each frame including tone mapping
+static BenchmarkResult benchmark(Level &level, const std::string& name, const BenchmarkPose& pose, bool preview, int AA, int iterations, int warmup) {
+    Scene &scene = *level.scene;
+
+    // Turn the starting direction, so every run sees the same view
+    glm::vec3 dir = scene.camera.dir;
+    float c = glm::cos(pose.turn);
+    float s = glm::sin(pose.turn);
+    scene.camera.dir = glm::vec3{(c * dir.x) - (s * dir.z), dir.y, (s * dir.x) + (c * dir.z)};
+    scene.camera.placeSprite();
+    scene.camera.setPreview(preview);
+    scene.AA = preview ? 1 : AA;
+
+    BenchmarkResult result;
+    result.level = name;
+    result.pose = pose.name;
+    result.preview = preview;
+    result.width = scene.camera.WIDTH;
+    result.height = scene.camera.HEIGHT;
+    result.AA = scene.AA;
+    result.accelerator = level.accelerator;
+    result.packets = scene.packets;
+    result.render_seconds = 0.0;
+
+    // The frame is kept across iterations, as the game keeps it across frames
+    std::vector<uint32_t> pixels(scene.camera.WIDTH * scene.camera.HEIGHT);
+    ProgressiveFrame frame;
+    for (int i = 0; i < warmup + iterations; i++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        RenderStats stats = render(pixels.data(), scene, *level.accel, frame);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        result.threads = stats.threads;
+        result.primary_rays = stats.primary_rays;
+        result.traversal = stats.traversal;
+        if (i >= warmup) {
+            result.ms.push_back(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0);
+            result.render_seconds += stats.seconds;
+        }
+    }
+    std::sort(result.ms.begin(), result.ms.end());
+
+    // Leave the camera and its sprite as the next view expects them
+    scene.camera.dir = dir;
+    scene.camera.placeSprite();
+    return result;
+}
+
+static void writeResults(std::ostream& out, const std::vector<BenchmarkResult>& results, const std::vector<std::string>& skipped, int iterations, int warmup) {
+    out << "{" << std::endl;
+    out << "  \"iterations\": " << iterations << "," << std::endl;
+    out << "  \"warmup\": " << warmup << "," << std::endl;
+    out << "  \"skipped\": [";
+    for (size_t s = 0; s < skipped.size(); s++) {
+        out << (s > 0 ? ", " : "") << "\"" << skipped[s] << "\"";
+    }
+    out << "]," << std::endl;
+    out << "  \"results\": [" << std::endl;
+    for (size_t r = 0; r < results.size(); r++) {
+        const BenchmarkResult &result = results[r];
+
+        double mean = 0.0;
+        for (double ms : result.ms) {
+            mean += ms / result.ms.size();
+        }
+
+        out << "    {\"level\": \"" << result.level << "\", \"pose\": \"" << result.pose << "\", \"resolution\": \"" << (result.preview ? "preview" : "full") << "\""
+            << ", \"width\": " << result.width << ", \"height\": " << result.height << ", \"aa\": " << result.AA
+            << ", \"accelerator\": \"" << result.accelerator << "\", \"packets\": " << (result.packets ? "true" : "false")
+            << ", \"threads\": " << result.threads << ", \"primary_rays\": " << result.primary_rays << "," << std::endl;
+        out << "     \"ms_per_frame\": {\"mean\": " << mean << ", \"min\": " << result.ms.front() << ", \"p50\": " << percentile(result.ms, 50.0)
+            << ", \"p90\": " << percentile(result.ms, 90.0) << ", \"p99\": " << percentile(result.ms, 99.0) << ", \"max\": " << result.ms.back() << "},"
+            << std::endl;
+        out << "     \"mrays_per_second\": " << result.primary_rays * result.ms.size() / result.render_seconds / 1000000.0;
+        #ifdef TRAVERSAL_STATS
+        out << "," << std::endl << "     \"traversal\": ";
+        result.traversal.writeJSON(out);
+        #endif
+        out << "}" << (r + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> levels;
+    std::string output = "";
+    int iterations = 10;
+    int warmup = 1;
+    LevelOptions options;
+    options.width = BENCHMARK_WIDTH;
+    options.height = BENCHMARK_HEIGHT;
+    options.preview_width = BENCHMARK_PREVIEW_WIDTH;
+    options.preview_height = BENCHMARK_PREVIEW_HEIGHT;
+    for (int a = 1; a < argc; a++) {
+        if (options.parse(argv[a])) {
+            continue;
+        } else if (strncmp(argv[a], "--iterations=", 13) == 0) {
+            iterations = atoi(argv[a] + 13);
+        } else if (strncmp(argv[a], "--warmup=", 9) == 0) {
+            warmup = atoi(argv[a] + 9);
+        } else if (strncmp(argv[a], "--output=", 9) == 0) {
+            output = argv[a] + 9;
+        } else if (strncmp(argv[a], "--", 2) != 0) {
+            levels.push_back(argv[a]);
+        } else {
+            std::cerr << "Unknown option " << argv[a] << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (iterations < 1 || warmup < 0) {
+        std::cerr << "Usage: benchmark [levels...] [--iterations=N] [--warmup=N] [--output=file.json] [--aa=N] ..." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (levels.empty()) {
+        levels = {"1", "2", "3", "4", "."};
+    }
+
+    // Loading messages would break the JSON on stdout, so they go to stderr
+    std::streambuf *stdout_buffer = std::cout.rdbuf(std::cerr.rdbuf());
+
+    std::vector<BenchmarkResult> results;
+    std::vector<std::string> skipped;
+    for (auto &name : levels) {
+        Level level;
+        if (!level.load(name + "/scene.json", options)) {
+            std::cerr << "Skipping level " << name << std::endl;
+            skipped.push_back(name);
+            continue;
+        }
+        int AA = level.scene->AA;
+
+        for (auto &pose : BENCHMARK_POSES) {
+            for (bool preview : {true, false}) {
+                results.push_back(benchmark(level, name, pose, preview, AA, iterations, warmup));
+
+                const BenchmarkResult &result = results.back();
+                std::cerr << "Level " << name << ", " << pose.name << ", " << result.width << "x" << result.height << ": "
+                          << percentile(result.ms, 50.0) << " ms per frame" << std::endl;
+            }
+        }
+    }
+
+    std::cout.rdbuf(stdout_buffer);
+    if (output.empty()) {
+        writeResults(std::cout, results, skipped, iterations, warmup);
+        return EXIT_SUCCESS;
+    }
+
+    std::ofstream out(output);
+    if (!out) {
+        std::cerr << "Failed to write results to " << output << std::endl;
+        return EXIT_FAILURE;
+    }
+    writeResults(out, results, skipped, iterations, warmup);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,370 @@
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <glm/common.hpp>
+#include "bvh.hpp"
+
+/* BVH CLASS */
+BVH::BVH() : leaf_size(1), leaves(0), depth(0), cost(0.0), build_time(0.0) {}
+
+float BVH::surfaceArea(const glm::vec3& min, const glm::vec3& max) const {
+    glm::vec3 d = max - min;
+    return 2.0f * ((d.x * d.y) + (d.y * d.z) + (d.z * d.x));
+}
+
+// Intersection cost of a leaf, whose primitives are tested leaf_size at a time
+float BVH::leafCost(int primitives) const {
+    return ((primitives + leaf_size - 1) / leaf_size) * BVH_INTERSECT_COST;
+}
+
+// Build a binned SAH hierarchy over the given primitive bounding boxes
+void BVH::build(const std::vector<glm::vec3>& mins, const std::vector<glm::vec3>& maxs, int primitives_per_leaf) {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    int n = mins.size();
+    leaf_size = primitives_per_leaf;
+    nodes.clear();
+    order.resize(n);
+    leaves = 0;
+    depth = 0;
+    cost = 0.0;
+
+    if (n == 0) {
+        build_time = 0.0;
+        return;
+    }
+
+    std::vector<glm::vec3> centroids(n);
+    for (int i = 0; i < n; i++) {
+        order[i] = i;
+        centroids[i] = (mins[i] + maxs[i]) * 0.5f;
+    }
+
+    nodes.reserve(2 * n);
+    nodes.push_back(BVHNode());
+    subdivide(0, 0, n, 1, mins, maxs, centroids);
+
+    // SAH cost of the finished tree relative to the root
+    float root_area = surfaceArea(nodes[0].min, nodes[0].max);
+    for (auto &node : nodes) {
+        float p = (root_area > 0) ? surfaceArea(node.min, node.max) / root_area : 1.0f;
+        if (node.count > 0) {
+            cost += p * leafCost(node.count);
+        } else {
+            cost += p * BVH_TRAVERSAL_COST;
+        }
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    build_time = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+}
+
+// Cost of testing the bounding box and then every primitive, for comparison
+float BVH::flatCost(int primitives) const {
+    return BVH_TRAVERSAL_COST + (primitives * BVH_INTERSECT_COST);
+}
+
+// True if the nodes form a tree traversal can walk, for hierarchies read back
+// from a compiled scene: children after their parent and within the nodes,
+// no deeper than the traversal stack, and leaves within items. leaf_count
+// receives the number of leaves.
+bool BVH::valid(int items, int &leaf_count) const {
+    leaf_count = 0;
+    if (depth < 0 || depth > BVH_MAX_DEPTH) {
+        return false;
+    }
+
+    int n = nodes.size();
+    std::vector<int> levels(n, 0);
+    for (int i = 0; i < n; i++) {
+        const BVHNode &node = nodes[i];
+        if (levels[i] > BVH_MAX_DEPTH) {
+            return false;
+        }
+
+        if (node.count > 0) {
+            if (node.first < 0 || node.first > items - node.count) {
+                return false;
+            }
+            leaf_count++;
+        } else {
+            if (node.count < 0 || node.first <= i || node.first >= n - 1) {
+                return false;
+            }
+            levels[node.first] = std::max(levels[node.first], levels[i] + 1);
+            levels[node.first + 1] = std::max(levels[node.first + 1], levels[i] + 1);
+        }
+    }
+    return true;
+}
+
+void BVH::subdivide(int index, int first, int count, int level, const std::vector<glm::vec3>& mins, const std::vector<glm::vec3>& maxs, const std::vector<glm::vec3>& centroids) {
+    glm::vec3 bmin{10000.0, 10000.0, 10000.0};
+    glm::vec3 bmax{-10000.0, -10000.0, -10000.0};
+    glm::vec3 cmin = bmin;
+    glm::vec3 cmax = bmax;
+    for (int i = first; i < first + count; i++) {
+        bmin = glm::min(bmin, mins[order[i]]);
+        bmax = glm::max(bmax, maxs[order[i]]);
+        cmin = glm::min(cmin, centroids[order[i]]);
+        cmax = glm::max(cmax, centroids[order[i]]);
+    }
+
+    nodes[index].min = bmin;
+    nodes[index].max = bmax;
+    nodes[index].first = first;
+    nodes[index].count = count;
+
+    depth = std::max(depth, level);
+
+    if (count <= 1 || level >= BVH_MAX_DEPTH) {
+        leaves++;
+        return;
+    }
+
+    // Find the cheapest split plane between centroid bins on every axis
+    float node_area = surfaceArea(bmin, bmax);
+    float best_cost = leafCost(count);
+    int best_axis = -1;
+    int best_bin = 0;
+
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = cmax[axis] - cmin[axis];
+        if (extent <= 0) {
+            continue;
+        }
+
+        int bin_count[BVH_BINS] = {0};
+        glm::vec3 bin_min[BVH_BINS];
+        glm::vec3 bin_max[BVH_BINS];
+        for (int b = 0; b < BVH_BINS; b++) {
+            bin_min[b] = glm::vec3{10000.0, 10000.0, 10000.0};
+            bin_max[b] = glm::vec3{-10000.0, -10000.0, -10000.0};
+        }
+
+        float scale = BVH_BINS / extent;
+        for (int i = first; i < first + count; i++) {
+            int b = std::min((int) ((centroids[order[i]][axis] - cmin[axis]) * scale), BVH_BINS - 1);
+            bin_count[b]++;
+            bin_min[b] = glm::min(bin_min[b], mins[order[i]]);
+            bin_max[b] = glm::max(bin_max[b], maxs[order[i]]);
+        }
+
+        // Sweep from the right to get the area of every right half
+        float right_area[BVH_BINS];
+        int right_count[BVH_BINS];
+        glm::vec3 rmin = bin_min[BVH_BINS - 1];
+        glm::vec3 rmax = bin_max[BVH_BINS - 1];
+        int rcount = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--) {
+            rmin = glm::min(rmin, bin_min[b]);
+            rmax = glm::max(rmax, bin_max[b]);
+            rcount += bin_count[b];
+            right_area[b] = (rcount > 0) ? surfaceArea(rmin, rmax) : 0.0f;
+            right_count[b] = rcount;
+        }
+
+        // Sweep from the left and evaluate the split after each bin
+        glm::vec3 lmin = bin_min[0];
+        glm::vec3 lmax = bin_max[0];
+        int lcount = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++) {
+            lmin = glm::min(lmin, bin_min[b]);
+            lmax = glm::max(lmax, bin_max[b]);
+            lcount += bin_count[b];
+            if (lcount == 0 || right_count[b + 1] == 0) {
+                continue;
+            }
+
+            float split_cost = BVH_TRAVERSAL_COST + ((leafCost(lcount) * surfaceArea(lmin, lmax)) + (leafCost(right_count[b + 1]) * right_area[b + 1])) / node_area;
+            if (split_cost < best_cost) {
+                best_cost = split_cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    // Make a leaf if no split is cheaper than intersecting everything
+    if (best_axis == -1) {
+        leaves++;
+        return;
+    }
+
+    float extent = cmax[best_axis] - cmin[best_axis];
+    float scale = BVH_BINS / extent;
+    float split_min = cmin[best_axis];
+    int *middle = std::partition(&order[first], &order[first] + count, [&](int p) {
+        return std::min((int) ((centroids[p][best_axis] - split_min) * scale), BVH_BINS - 1) <= best_bin;
+    });
+    int left_count = middle - &order[first];
+
+    if (left_count == 0 || left_count == count) {
+        leaves++;
+        return;
+    }
+
+    int left = nodes.size();
+    nodes.push_back(BVHNode());
+    nodes.push_back(BVHNode());
+    nodes[index].first = left;
+    nodes[index].count = 0;
+
+    subdivide(left, first, left_count, level + 1, mins, maxs, centroids);
+    subdivide(left + 1, first + left_count, count - left_count, level + 1, mins, maxs, centroids);
+}
+
+// Slab test against a node's box, rejecting boxes entirely behind the origin
+bool BVH::intersectNode(const BVHNode& node, const glm::vec3& origin, const glm::vec3& invdir, float &t_min, float &t_max) const {
+    COUNT_TRAVERSAL(box_tests, 1);
+
+    glm::vec3 t0 = (node.min - origin) * invdir;
+    glm::vec3 t1 = (node.max - origin) * invdir;
+    glm::vec3 t_near = glm::min(t0, t1);
+    glm::vec3 t_far = glm::max(t0, t1);
+
+    // A ray lying in a face plane gives 0 * inf = NaN, which bounds nothing
+    for (int i = 0; i < 3; i++) {
+        if (std::isnan(t0[i]) || std::isnan(t1[i])) {
+            t_near[i] = -INFINITY;
+            t_far[i] = INFINITY;
+        }
+    }
+
+    t_min = std::max({t_near.x, t_near.y, t_near.z});
+    t_max = std::min({t_far.x, t_far.y, t_far.z});
+
+    return t_max >= std::max(t_min, 0.0f);
+}
+
+// Visit leaves front to back, skipping nodes that start beyond the closest hit.
+// intersectLeaf(first, count) tests a leaf's primitives, updates t_closest and
+// returns true to end the traversal early.
+template <typename LeafFunc>
+void BVH::traverse(const glm::vec3& origin, const glm::vec3& invdir, float &t_closest, LeafFunc intersectLeaf) const {
+    if (nodes.empty()) {
+        return;
+    }
+
+    float t_min, t_max;
+    if (!intersectNode(nodes[0], origin, invdir, t_min, t_max) || t_min > t_closest) {
+        return;
+    }
+
+    int stack[BVH_MAX_DEPTH + 1];
+    float stack_t[BVH_MAX_DEPTH + 1];
+    int top = 0;
+    int current = 0;
+
+    while (true) {
+        const BVHNode &node = nodes[current];
+
+        if (node.count > 0) {
+            if (intersectLeaf(node.first, node.count)) {
+                return;
+            }
+        } else {
+            float near_min, near_max, far_min, far_max;
+            int near = node.first;
+            int far = node.first + 1;
+            bool hit_near = intersectNode(nodes[near], origin, invdir, near_min, near_max) && near_min <= t_closest;
+            bool hit_far = intersectNode(nodes[far], origin, invdir, far_min, far_max) && far_min <= t_closest;
+
+            if (hit_near && hit_far) {
+                if (far_min < near_min) {
+                    std::swap(near, far);
+                    std::swap(near_min, far_min);
+                }
+                stack[top] = far;
+                stack_t[top] = far_min;
+                top++;
+                current = near;
+                continue;
+            } else if (hit_near) {
+                current = near;
+                continue;
+            } else if (hit_far) {
+                current = far;
+                continue;
+            }
+        }
+
+        // Pop the next node that may still hold a closer hit
+        bool found = false;
+        while (top > 0) {
+            top--;
+            if (stack_t[top] <= t_closest) {
+                current = stack[top];
+                found = true;
+                break;
+            }
+        }
+
+        if (!found) {
+            return;
+        }
+    }
+}
+
+// Visit leaves reached by any ray of a packet, nearer child first. The packet's
+// intersectBox(min, max, t_entry) returns the mask of rays entering a box
+// before their closest hit, so nodes are tested again when popped.
+template <typename Packet, typename LeafFunc>
+void BVH::traversePacket(const Packet& packet, LeafFunc intersectLeaf) const {
+    if (nodes.empty()) {
+        return;
+    }
+
+    float t_entry;
+    if (!packet.intersectBox(nodes[0].min, nodes[0].max, t_entry)) {
+        return;
+    }
+
+    int stack[BVH_MAX_DEPTH + 1];
+    int top = 0;
+    int current = 0;
+
+    while (true) {
+        const BVHNode &node = nodes[current];
+
+        if (node.count > 0) {
+            intersectLeaf(node.first, node.count);
+        } else {
+            float near_t, far_t;
+            int near = node.first;
+            int far = node.first + 1;
+            bool hit_near = packet.intersectBox(nodes[near].min, nodes[near].max, near_t) != 0;
+            bool hit_far = packet.intersectBox(nodes[far].min, nodes[far].max, far_t) != 0;
+
+            if (hit_near && hit_far) {
+                if (far_t < near_t) {
+                    std::swap(near, far);
+                }
+                stack[top++] = far;
+                current = near;
+                continue;
+            } else if (hit_near) {
+                current = near;
+                continue;
+            } else if (hit_far) {
+                current = far;
+                continue;
+            }
+        }
+
+        bool found = false;
+        while (top > 0) {
+            top--;
+            if (packet.intersectBox(nodes[stack[top]].min, nodes[stack[top]].max, t_entry)) {
+                current = stack[top];
+                found = true;
+                break;
+            }
+        }
+
+        if (!found) {
+            return;
+        }
+    }
+}
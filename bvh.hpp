@@ -0,0 +1,61 @@
+#ifndef __BVH_HPP__
+#define __BVH_HPP__
+
+#include <vector>
+#include <glm/vec3.hpp>
+#include "traversalstats.hpp"
+
+// Relative costs used by the surface area heuristic
+const float BVH_TRAVERSAL_COST = 1.0;
+const float BVH_INTERSECT_COST = 1.0;
+const int BVH_BINS = 16;
+const int BVH_MAX_DEPTH = 60;
+
+class BVHNode {
+public:
+
+    glm::vec3 min;
+    glm::vec3 max;
+    int first; // First primitive for a leaf, left child for an interior node
+    int count; // Number of primitives, 0 for an interior node
+
+};
+
+class BVH {
+public:
+
+    std::vector<BVHNode> nodes;
+    std::vector<int> order; // Primitive order after build, leaves index into it
+    int leaf_size; // Primitives tested together at a leaf, as one unit of SAH cost
+
+    // Build statistics
+    int leaves;
+    int depth;
+    float cost;
+    double build_time;
+
+    BVH();
+
+    void build(const std::vector<glm::vec3>& mins, const std::vector<glm::vec3>& maxs, int primitives_per_leaf = 1);
+    float flatCost(int primitives) const;
+    bool valid(int items, int &leaf_count) const;
+
+    template <typename LeafFunc>
+    void traverse(const glm::vec3& origin, const glm::vec3& invdir, float &t_closest, LeafFunc intersectLeaf) const;
+
+    template <typename Packet, typename LeafFunc>
+    void traversePacket(const Packet& packet, LeafFunc intersectLeaf) const;
+
+private:
+
+    bool intersectNode(const BVHNode& node, const glm::vec3& origin, const glm::vec3& invdir, float &t_min, float &t_max) const;
+
+    void subdivide(int index, int first, int count, int level, const std::vector<glm::vec3>& mins, const std::vector<glm::vec3>& maxs, const std::vector<glm::vec3>& centroids);
+    float surfaceArea(const glm::vec3& min, const glm::vec3& max) const;
+    float leafCost(int primitives) const;
+
+};
+
+#include "bvh.cpp"
+
+#endif
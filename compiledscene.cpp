@@ -0,0 +1,110 @@
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include "compiledscene.hpp"
+
+/* SCENE SOURCE CLASS */
+// Record a file's size and modification time, false if it does not exist
+bool SceneSource::read(const std::string& file) {
+    struct stat info;
+    path = file;
+    if (stat(file.c_str(), &info) != 0) {
+        size = SCENE_SOURCE_MISSING;
+        modified = 0;
+        return false;
+    }
+
+    size = info.st_size;
+    modified = info.st_mtime;
+    return true;
+}
+
+/* SCENE WRITER CLASS */
+template <typename T>
+void SceneWriter::put(const T& value) {
+    const char *p = reinterpret_cast<const char*>(&value);
+    bytes.insert(bytes.end(), p, p + sizeof(T));
+}
+
+template <typename T>
+void SceneWriter::putArray(const T *values, uint32_t count) {
+    put(count);
+    bytes.resize((bytes.size() + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT, 0);
+
+    const char *p = reinterpret_cast<const char*>(values);
+    bytes.insert(bytes.end(), p, p + sizeof(T) * count);
+}
+
+void SceneWriter::putString(const std::string& s) {
+    putArray(s.data(), s.size());
+}
+
+// Write to a temporary file and move it into place, so a reader never maps half a file
+bool SceneWriter::save(const std::string& path) const {
+    std::string temporary = path + ".tmp";
+    std::ofstream f(temporary, std::ofstream::binary | std::ofstream::trunc);
+    if (!f.write(bytes.data(), bytes.size())) {
+        return false;
+    }
+    f.close();
+
+    std::remove(path.c_str());
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+/* SCENE READER CLASS */
+SceneReader::SceneReader(const char *d, size_t s) : ok(true), data(d), size(s), offset(0) {}
+
+// The next bytes of the file, null once the file runs out
+const char *SceneReader::take(size_t bytes) {
+    if (!ok || bytes > size - offset) {
+        ok = false;
+        return nullptr;
+    }
+
+    const char *p = data + offset;
+    offset += bytes;
+    return p;
+}
+
+template <typename T>
+T SceneReader::get() {
+    T value{};
+    const char *p = take(sizeof(T));
+    if (p != nullptr) {
+        memcpy(&value, p, sizeof(T));
+    }
+    return value;
+}
+
+// An array where it lies in the file
+template <typename T>
+const T *SceneReader::getArray(uint32_t &count) {
+    count = get<uint32_t>();
+    size_t aligned = (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+    take(aligned - offset);
+
+    const char *p = take(sizeof(T) * (size_t) count);
+    if (p == nullptr) {
+        count = 0;
+    }
+    return reinterpret_cast<const T*>(p);
+}
+
+// A copy of an array
+template <typename T>
+void SceneReader::getArray(std::vector<T>& values) {
+    uint32_t count;
+    const T *p = getArray<T>(count);
+    values.resize(count);
+    if (count > 0) {
+        memcpy(values.data(), p, sizeof(T) * count);
+    }
+}
+
+std::string SceneReader::getString() {
+    uint32_t length;
+    const char *p = getArray<char>(length);
+    return std::string(p == nullptr ? "" : p, length);
+}
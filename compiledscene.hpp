@@ -0,0 +1,99 @@
+#ifndef __COMPILEDSCENE_HPP__
+#define __COMPILEDSCENE_HPP__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <glm/vec3.hpp>
+#include "mappedfile.hpp"
+
+// A compiled scene is a level already built: its objects, model BVHs,
+// textures with their mipmaps and acceleration structure, written by
+// compilescene next to the scene.json it came from. Level::load maps it and
+// copies each part out with a memcpy, so starting a level parses no JSON, OBJ
+// or image files and builds no BVH, grid or mipmaps.
+//
+// The file is a header followed by plain data. Every array is prefixed with
+// its length and starts on a SCENE_CACHE_ALIGNMENT boundary. Files from
+// another version, or from a build with a different TriangleBlock layout, are
+// ignored, as are files older than any of the sources they list.
+const uint32_t SCENE_CACHE_MAGIC = 0x4e435352; // "RSCN"
+const uint32_t SCENE_CACHE_VERSION = 5;
+const int SCENE_CACHE_ALIGNMENT = 32;
+
+enum CompiledKind {COMPILED_SPHERE, COMPILED_TRIANGLE, COMPILED_TEXTURED_TRIANGLE, COMPILED_MODEL};
+
+// One scene object. Spheres keep their center in v0 and radius in v1.x.
+class CompiledObject {
+public:
+
+    int kind;
+    glm::vec3 color;
+    int material; // Index in the material table
+    glm::vec3 v0, v1, v2;
+    int texture; // Textured triangles
+    int bottom;
+    int model; // Models, index in the model section
+
+};
+
+// Size of a source file that did not exist when it was read
+const int64_t SCENE_SOURCE_MISSING = -1;
+
+// A file the compiled scene was made from, to tell when it is out of date
+class SceneSource {
+public:
+
+    std::string path;
+    int64_t size; // SCENE_SOURCE_MISSING if the file does not exist
+    int64_t modified;
+
+    bool read(const std::string& file);
+
+};
+
+class SceneWriter {
+public:
+
+    std::vector<char> bytes;
+
+    template <typename T>
+    void put(const T& value);
+    template <typename T>
+    void putArray(const T *values, uint32_t count);
+    void putString(const std::string& s);
+
+    bool save(const std::string& path) const;
+
+};
+
+// Reads back what SceneWriter wrote. Reading past the end returns zeros and
+// empty arrays and clears ok, so callers check it once at the end.
+class SceneReader {
+public:
+
+    bool ok;
+
+    SceneReader(const char *d, size_t s);
+
+    template <typename T>
+    T get();
+    template <typename T>
+    const T *getArray(uint32_t &count);
+    template <typename T>
+    void getArray(std::vector<T>& values);
+    std::string getString();
+
+private:
+
+    const char *data;
+    size_t size;
+    size_t offset;
+
+    const char *take(size_t bytes);
+
+};
+
+#include "compiledscene.cpp"
+
+#endif
@@ -0,0 +1,62 @@
+// Builds levels from their scene.json and writes each one beside it as a
+// compiled scene.bin, which the game, headless and benchmark load in place of
+// the JSON, OBJ and texture files while none of those has changed:
+//
+//   compilescene [levels...] [--accel=grid|fixed-grid|bvh]
+//
+// Without levels it compiles 1 to 4 and the scene.json in the working
+// directory. The acceleration structure is compiled as the scene or --accel
+// chooses, and one of another kind is still built at load time. Paths in the
+// compiled scene are relative, so run it from where the game is run.
+
+#define cimg_display 0
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+
+#include "raytrace.hpp"
+#include "level.hpp"
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> levels;
+    LevelOptions options;
+    options.compiled = "off";
+    for (int a = 1; a < argc; a++) {
+        if (strncmp(argv[a], "--accel=", 8) == 0) {
+            options.accelerator = argv[a] + 8;
+        } else if (strncmp(argv[a], "--", 2) != 0) {
+            levels.push_back(argv[a]);
+        } else {
+            std::cerr << "Usage: compilescene [levels...] [--accel=grid|fixed-grid|bvh]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (levels.empty()) {
+        levels = {"1", "2", "3", "4", "."};
+    }
+
+    int failed = 0;
+    for (auto &name : levels) {
+        std::string path = name + "/scene.json";
+        Level level;
+        if (!level.load(path, options)) {
+            std::cerr << "Failed to load " << path << std::endl;
+            failed++;
+            continue;
+        }
+
+        std::string output = Level::compiledPath(path);
+        if (!level.save(output)) {
+            std::cerr << "Failed to write " << output << std::endl;
+            failed++;
+            continue;
+        }
+        std::cout << "Compiled " << path << " to " << output << " with " << level.scene->objects.size() << " objects, "
+                  << level.scene->textures.size() << " textures and a " << level.accelerator << std::endl;
+    }
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,40 +1,79 @@
 #include <glm/geometric.hpp>
 #include <glm/exponential.hpp>
+#include <glm/common.hpp>
 #include <vector>
 #include <algorithm>
-#include "CImg.h"
 #include "geometry.hpp"
 
-using cimg_library::CImg;
-
 /* SHAPE */
 
-Shape::Shape() : color(glm::vec3{1.0, 1.0, 1.0}), model(false) {}
-Shape::Shape(glm::vec3 col) : color(col), lambert(1.0), specular(0.0), model(false) {}
-Shape::Shape(glm::vec3 col, float lam, float spec, bool refr, float ior) : color(col), lambert(lam), specular(spec), refractive(refr), IoR(ior), model(false) {}
+// Plain diffuse, for shapes made without a scene's material table
+static const Material default_material;
+
+// A ray leaving a hit carries on from the footprint the incoming ray had there
+static inline void continueFootprint(const Ray& ray, const glm::vec3& point, Ray& next) {
+    next.cone = ray.cone + (glm::length(point - ray.origin) * ray.spread);
+    next.spread = ray.spread;
+}
+
+Shape::Shape() : color(glm::vec3{1.0, 1.0, 1.0}), material(&default_material), model(false), id(-1) {}
+Shape::Shape(glm::vec3 col) : color(col), material(&default_material), model(false), id(-1) {}
+Shape::Shape(glm::vec3 col, const Material *mat) : color(col), material(mat), model(false), id(-1) {}
 Shape::~Shape() {}
 
-glm::vec3 Shape::surface(const Ray& ray, const glm::vec3& point, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Grid &grid) const {
+// Intersect with the shape, keeping collision if it is closer
+bool Shape::intersectClosest(const Ray& ray, Intersection &collision) const {
+    float t_test;
+    if (intersect(ray, t_test) && t_test < collision.t && t_test >= 0) {
+        collision.hit = true;
+        collision.obj = const_cast<Shape*>(this);
+        collision.point = ray.origin + (ray.vector * t_test);
+        collision.t = t_test;
+        return true;
+    }
 
-    glm::vec3 norm = this->normal(point, ray);
+    return false;
+}
 
-    glm::vec3 lambert_color{0.0, 0.0, 0.0};
-    if (lambert) {
-        for (auto &l : lights) {
+// Repeat a hit test for one ray, given the primitive a packet test found.
+// Only models have primitives, so other shapes test themselves.
+bool Shape::intersectPrimitive(const Ray& ray, int primitive, Intersection &collision) const {
+    return intersectClosest(ray, collision);
+}
 
-            if (l->visible(point + (norm * 0.01f), objects, grid, norm)) {
-                float contribution = glm::dot(glm::normalize(l->position - point), norm);
-                if (contribution > 0) {
-                    lambert_color += (l->color * contribution);
-                }
-            }
+// Test each ray of a packet on its own, for shapes without a vector version
+void Shape::intersectPacket(RayPacket& packet) const {
+    float t_test;
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if ((packet.active & (1 << l)) && intersect(packet.rays[l], t_test) && t_test < packet.t[l] && t_test >= 0) {
+            packet.t[l] = t_test;
+            packet.hit[l] = const_cast<Shape*>(this);
         }
+    }
+}
 
+// Any hit test for shadow rays: true if the shape blocks the ray before t_max
+bool Shape::occludes(const Ray& ray, float t_max) const {
+    float t;
+    return intersect(ray, t) && t >= 0 && t < t_max;
+}
+
+glm::vec3 Shape::surface(const Ray& ray, const Intersection& collision, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Accelerator &accel) const {
+
+    const glm::vec3 &point = collision.point;
+    glm::vec3 norm = this->surfaceNormal(collision, ray);
+    const float lambert = material->lambert;
+    const float specular = material->specular;
+    const float IoR = material->IoR;
+
+    glm::vec3 lambert_color{0.0, 0.0, 0.0};
+    if (lambert) {
+        lambert_color = diffuseLight(point, norm, objects, lights, accel);
         lambert_color *= this->color; // scale it by the object's color
     }
 
     glm::vec3 refracted_color{0.0, 0.0, 0.0};
-    if (refractive) {
+    if (material->refractive) {
 
         float otherIoR = IoR;
         glm::vec3 refr_norm = norm;
@@ -47,83 +86,76 @@ glm::vec3 Shape::surface(const Ray& ray, const glm::vec3& point, const std::vect
 
         Ray refracted_ray{point + (refracted_vec * 0.01f), refracted_vec};
         refracted_ray.IoR = otherIoR;
+        continueFootprint(ray, point, refracted_ray);
         
-        glm::vec3 refracted_color = trace(refracted_ray, objects, lights, grid);
+        glm::vec3 refracted_color = trace(refracted_ray, objects, lights, accel);
 
         return (this->color * refracted_color);
     }
 
     glm::vec3 specular_color{0.0, 0.0, 0.0};
     if (specular) {
-        glm::vec3 reflected_vec = glm::reflect(ray.vector, norm);
-        Ray reflected_ray{point + (reflected_vec * 0.01f), reflected_vec};
-        reflected_ray.depth = ray.depth + 1;
-
-        specular_color = trace(reflected_ray, objects, lights, grid);
+        specular_color = reflection(ray, point, norm, objects, lights, accel);
     }
 
     return (lambert_color * lambert) + (specular_color * specular);
 }
 
 
-/* SPHERE */
-
-// Constructor for a white sphere
-Sphere::Sphere(glm::vec3 ctr, float r) : center{ctr}, radius{r} {}
-
-// Constructor for a sphere of specified color
-Sphere::Sphere(glm::vec3 ctr, float r, glm::vec3 col) : Shape(col), center{ctr}, radius{r} {}
+// Normal at a hit, for shapes whose normal depends on more than the point
+glm::vec3 Shape::surfaceNormal(const Intersection& collision, const Ray& ray) const {
+    return normal(collision.point, ray);
+}
 
-// Constructor for a sphere of specified color and material
-Sphere::Sphere(glm::vec3 ctr, float r, glm::vec3 col, float lam, float spec, bool refr, float ior) : Shape(col, lam, spec, refr, ior), center{ctr}, radius{r} {}
+// Color the surface reflects diffusely where a ray hits it
+glm::vec3 Shape::albedo(const Ray& ray, const Intersection& collision) const {
+    return color;
+}
 
-// from https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-sphere-intersection
-bool Sphere::solveQuadratic (const float &a, const float &b, const float &c, float &x0, float &x1) const {
-    float discr = (b * b) - (4 * a * c);
-    if (discr < 0) {
-        return false;
-    } else if (discr == 0) {
-        x0 = x1 = -b/(2 * a);
-    } else {
-        float q = (b > 0) ? (-0.5 * (b + glm::sqrt(discr))) : (-0.5 * (b - glm::sqrt(discr)));
-        x0 = q / a;
-        x1 = c / q;
-    }
+// Light from every light that reaches a point unblocked, before it is scaled
+// by the surface's color
+glm::vec3 Shape::diffuseLight(const glm::vec3& point, const glm::vec3& norm, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Accelerator &accel) const {
+    glm::vec3 light{0.0, 0.0, 0.0};
+    for (auto &l : lights) {
 
-    if (x0 > x1) {
-        std::swap(x0, x1);
+        if (l->visible(point + (norm * 0.01f), objects, accel, norm)) {
+            float contribution = glm::dot(glm::normalize(l->position - point), norm);
+            if (contribution > 0) {
+                light += (l->color * contribution);
+            }
+        }
     }
 
-    return true;
+    return light;
 }
 
-// from https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/minimal-ray-tracer-rendering-spheres
-bool Sphere::intersect(const Ray &ray, float &t) {
-    float t0, t1;
+// Color seen in the mirror direction of a ray hitting a point
+glm::vec3 Shape::reflection(const Ray& ray, const glm::vec3& point, const glm::vec3& norm, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Accelerator &accel) const {
+    glm::vec3 reflected_vec = glm::reflect(ray.vector, norm);
+    Ray reflected_ray{point + (reflected_vec * 0.01f), reflected_vec};
+    reflected_ray.depth = ray.depth + 1;
+    continueFootprint(ray, point, reflected_ray);
 
-    glm::vec3 L = ray.origin - center;
-    float a = glm::dot(ray.vector, ray.vector);
-    float b = 2 * glm::dot(ray.vector, L);
-    float c = glm::dot(L, L) - (radius*radius);
+    return trace(reflected_ray, objects, lights, accel);
+}
 
-    if (!solveQuadratic(a, b, c, t0, t1)) {
-        return false;
-    }
+/* SPHERE */
 
-    if (t0 > t1) {
-        std::swap(t0, t1);
-    }
+// Constructor for a white sphere
+Sphere::Sphere(glm::vec3 ctr, float r) : center{ctr}, radius{r} {}
 
-    if (t0 < 0) {
-        if (t1 < 0) {
-            return false;
-        }
-        t0 = t1;
-    }
+// Constructor for a sphere of specified color
+Sphere::Sphere(glm::vec3 ctr, float r, glm::vec3 col) : Shape(col), center{ctr}, radius{r} {}
 
-    t = t0;
+// Constructor for a sphere of specified color and material
+Sphere::Sphere(glm::vec3 ctr, float r, glm::vec3 col, const Material *mat) : Shape(col, mat), center{ctr}, radius{r} {}
 
-    return true;
+bool Sphere::intersect(const Ray &ray, float &t) const {
+    return SphereData(*this).intersect(ray, t);
+}
+
+void Sphere::intersectPacket(RayPacket& packet) const {
+    SphereData(*this).intersectPacket(packet);
 }
 
 glm::vec3 Sphere::normal(const glm::vec3& point, const Ray& ray) const {
@@ -144,42 +176,41 @@ Triangle::Triangle(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2) :
     v0(p0), v1(p1), v2(p2) {}
 Triangle::Triangle(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2, glm::vec3 col) :
     Shape(col), v0(p0), v1(p1), v2(p2) {}
-Triangle::Triangle(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2, glm::vec3 col, float lam, float spec, bool refr, float ior) :
-    Shape(col, lam, spec, refr, ior), v0(p0), v1(p1), v2(p2) {}
-
-// From https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection
-bool Triangle::intersect(const Ray& ray, float &t) {
+Triangle::Triangle(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2, glm::vec3 col, const Material *mat) :
+    Shape(col, mat), v0(p0), v1(p1), v2(p2) {}
 
-    glm::vec3 AB = v1 - v0;
-    glm::vec3 AC = v2 - v0;
-    glm::vec3 cramer_p = glm::cross(ray.vector, AC);
-    float det = glm::dot(AB, cramer_p);
-    
-    // Disregard triangle if triangle is backfacing
-    if (fabs(det) < 0.0000001) {
-        return false;
-    }
-
-    float inv_det = 1.0 / det;
+bool Triangle::intersect(const Ray& ray, float &t) const {
+    float u, v;
+    return intersect(ray, t, u, v);
+}
 
-    glm::vec3 cramer_t = ray.origin - v0;
-    float u = glm::dot(cramer_t, cramer_p) * inv_det;
-    if (u < 0 || u > 1) {
-        return false;
-    }
+// Also gives the barycentric coordinates of the hit
+bool Triangle::intersect(const Ray& ray, float &t, float &u, float &v) const {
+    return TriangleData(*this).intersect(ray, t, u, v);
+}
 
-    glm::vec3 cramer_q = glm::cross(cramer_t, AB);
-    float v = glm::dot(ray.vector, cramer_q) * inv_det;
-    if (v < 0 || (u + v) > 1) {
-        return false;
+// Also records the barycentric coordinates, which texturing needs
+bool Triangle::intersectClosest(const Ray& ray, Intersection &collision) const {
+    float t_test, u, v;
+    if (intersect(ray, t_test, u, v) && t_test < collision.t && t_test >= 0) {
+        collision.hit = true;
+        collision.obj = const_cast<Triangle*>(this);
+        collision.point = ray.origin + (ray.vector * t_test);
+        collision.t = t_test;
+        collision.u = u;
+        collision.v = v;
+        return true;
     }
 
-    t = glm::dot(AC, cramer_q) * inv_det;
+    return false;
+}
 
-    return true;
+void Triangle::intersectPacket(RayPacket& packet) const {
+    TriangleData(*this).intersectPacket(packet);
 }
 
-glm::vec3 Triangle::normal(const glm::vec3& point, const Ray& ray) const {
+// Normal of a triangle's plane, on the side the ray comes from
+static glm::vec3 faceNormal(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, const Ray& ray) {
     glm::vec3 a = v1 - v0;
     glm::vec3 b = v2 - v0;
 
@@ -191,6 +222,10 @@ glm::vec3 Triangle::normal(const glm::vec3& point, const Ray& ray) const {
     }
 }
 
+glm::vec3 Triangle::normal(const glm::vec3& point, const Ray& ray) const {
+    return faceNormal(v0, v1, v2, ray);
+}
+
 glm::vec3 Triangle::min() const {
     return glm::vec3{std::min({v0.x, v1.x, v2.x}), std::min({v0.y, v1.y, v2.y}), std::min({v0.z, v1.z, v2.z})};
 }
@@ -202,38 +237,174 @@ glm::vec3 Triangle::max() const {
 /* MODEL */
 Model::Model() {model = true;};
 
-bool Model::intersect(const Ray& ray, float &t) {
-    float ti, tj; // Dummy variables for the box intersection
-    if (!ray.intersectBox(minimum, maximum, ti, tj)) {
-        return false;
+Model::Model(glm::vec3 col, const Material *mat) : Shape(col, mat) {model = true;}
+
+// Build the triangle hierarchy and reorder triangles to match its leaves, then
+// pack each leaf into triangle blocks. Leaf nodes index blocks afterwards.
+void Model::build() {
+    int n = indices.size();
+    std::vector<glm::vec3> mins(n);
+    std::vector<glm::vec3> maxs(n);
+    for (int i = 0; i < n; i++) {
+        const glm::ivec3 &f = indices[i];
+        mins[i] = glm::min(glm::min(vertices[f.x], vertices[f.y]), vertices[f.z]);
+        maxs[i] = glm::max(glm::max(vertices[f.x], vertices[f.y]), vertices[f.z]);
     }
 
-    float t_model = 10000.0;
-    float t_test;
+    bvh.build(mins, maxs, TRIANGLE_BLOCK_SIZE);
 
-    int thread = omp_get_thread_num();
-    intersected_tri[thread].hit = false;
-    
-    for (auto &tri : triangles) {
-        if (tri->intersect(ray, t_test) && t_test < t_model && t_test >= 0) {
-            t_model = t_test;
-            intersected_tri[thread].hit = true;
-            intersected_tri[thread].obj = tri;
-            intersected_tri[thread].point = ray.origin + (ray.vector * t_model);
-            intersected_tri[thread].t = t_model;
+    std::vector<glm::ivec3> ordered(n);
+    for (int i = 0; i < n; i++) {
+        ordered[i] = indices[bvh.order[i]];
+    }
+    indices.swap(ordered);
+
+    if (!normal_indices.empty()) {
+        for (int i = 0; i < n; i++) {
+            ordered[i] = normal_indices[bvh.order[i]];
         }
+        normal_indices.swap(ordered);
     }
 
-    if (intersected_tri[thread].hit) {
-        t = t_model;
+    blocks.clear();
+    for (auto &node : bvh.nodes) {
+        if (node.count == 0) {
+            continue;
+        }
+
+        int first_block = blocks.size();
+        for (int i = node.first; i < node.first + node.count; i++) {
+            if ((i - node.first) % TRIANGLE_BLOCK_SIZE == 0) {
+                blocks.push_back(TriangleBlock());
+            }
+            blocks.back().add(vertices[indices[i].x], vertices[indices[i].y], vertices[indices[i].z], i);
+        }
+        node.first = first_block;
+        node.count = blocks.size() - first_block;
+    }
+}
+
+bool Model::intersect(const Ray& ray, float &t) const {
+    Intersection collision;
+    if (intersectClosest(ray, collision)) {
+        t = collision.t;
         return true;
     }
 
     return false;
 }
 
+// The collision records the triangle hit as its primitive
+bool Model::intersectClosest(const Ray& ray, Intersection &collision) const {
+    float t_model = collision.t;
+    bool found = false;
+
+    bvh.traverse(ray.origin, ray.invdir, t_model, [&](int first, int count) {
+        BlockHit block_hit;
+        for (int b = first; b < first + count; b++) {
+            if (blocks[b].intersect(ray.origin, ray.vector, t_model, block_hit)) {
+                t_model = block_hit.t;
+                collision.hit = true;
+                collision.obj = const_cast<Model*>(this);
+                collision.primitive = blocks[b].index[block_hit.lane];
+                collision.point = ray.origin + (ray.vector * t_model);
+                collision.t = t_model;
+                collision.u = block_hit.u;
+                collision.v = block_hit.v;
+                found = true;
+            }
+        }
+        return false;
+    });
+
+    return found;
+}
+
+// Test one triangle alone, the way a scene triangle is tested
+bool Model::intersectPrimitive(const Ray& ray, int primitive, Intersection &collision) const {
+    if (primitive < 0) {
+        return intersectClosest(ray, collision);
+    }
+
+    const glm::ivec3 &f = indices[primitive];
+    float t_test, u, v;
+    if (TriangleData(vertices[f.x], vertices[f.y], vertices[f.z], const_cast<Model*>(this), id).intersect(ray, t_test, u, v) && t_test < collision.t && t_test >= 0) {
+        collision.hit = true;
+        collision.obj = const_cast<Model*>(this);
+        collision.primitive = primitive;
+        collision.point = ray.origin + (ray.vector * t_test);
+        collision.t = t_test;
+        collision.u = u;
+        collision.v = v;
+        return true;
+    }
+
+    return false;
+}
+
+// Packet version of intersect, recording the triangle each ray hits
+void Model::intersectPacket(RayPacket& packet) const {
+    bvh.traversePacket(packet, [&](int first, int count) {
+        BlockHit block_hit;
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            if (!(packet.active & (1 << l))) {
+                continue;
+            }
+            for (int b = first; b < first + count; b++) {
+                if (blocks[b].intersect(packet.rays[l].origin, packet.rays[l].vector, packet.t[l], block_hit)) {
+                    packet.t[l] = block_hit.t;
+                    packet.hit[l] = const_cast<Model*>(this);
+                    packet.primitive[l] = blocks[b].index[block_hit.lane];
+                }
+            }
+        }
+    });
+}
+
+// Stop at the first triangle between the ray origin and t_max
+bool Model::occludes(const Ray& ray, float t_max) const {
+    bool blocked = false;
+    bvh.traverse(ray.origin, ray.invdir, t_max, [&](int first, int count) {
+        BlockHit block_hit;
+        for (int b = first; b < first + count; b++) {
+            if (blocks[b].intersect(ray.origin, ray.vector, t_max, block_hit)) {
+                blocked = true;
+                return true;
+            }
+        }
+        return false;
+    });
+
+    return blocked;
+}
+
+// Without the hit record the triangle has to be found again
 glm::vec3 Model::normal(const glm::vec3 &point, const Ray& ray) const {
-    return intersected_tri[omp_get_thread_num()].obj->normal(point, ray);
+    Intersection collision;
+    if (intersectClosest(ray, collision)) {
+        return surfaceNormal(collision, ray);
+    }
+
+    return -ray.vector;
+}
+
+// The hit triangle's normal, blended from its corner normals when the model
+// has them, turned to face the ray
+glm::vec3 Model::surfaceNormal(const Intersection& collision, const Ray& ray) const {
+    if (collision.primitive < 0) {
+        return normal(collision.point, ray);
+    }
+
+    if (!normal_indices.empty()) {
+        const glm::ivec3 &n = normal_indices[collision.primitive];
+        if (n.x >= 0 && n.y >= 0 && n.z >= 0) {
+            glm::vec3 blended = glm::normalize(((1.0f - collision.u - collision.v) * normals[n.x]) + (collision.u * normals[n.y]) + (collision.v * normals[n.z]));
+            return (glm::dot(blended, ray.vector) < 0) ? blended : -blended;
+        }
+    }
+
+    const glm::ivec3 &f = indices[collision.primitive];
+    return faceNormal(vertices[f.x], vertices[f.y], vertices[f.z], ray);
 }
 
 glm::vec3 Model::min() const {
@@ -245,80 +416,233 @@ glm::vec3 Model::max() const {
 }
 
 /* TEXTURED RECTANGLE */
-TexturedTriangle::TexturedTriangle(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2, float lam, float spec, bool refr, float ior, CImg<float>& tex, bool bot) :
-    Triangle(p0, p1, p2, glm::vec3{1.0, 1.0, 1.0}, lam, spec, refr, ior), texture(tex), bottom(bot) {
+TexturedTriangle::TexturedTriangle(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2, const Material *mat, const Texture& tex, bool bot) :
+    Triangle(p0, p1, p2, glm::vec3{1.0, 1.0, 1.0}, mat), bottom(bot), texture(tex) {
+    // The triangle covers half the image, so this is log2 of the texels
+    // along each side of a unit of its area
+    float area = 0.5f * glm::length(glm::cross(v1 - v0, v2 - v0));
+    lod_bias = 0.5f * glm::log2((0.5f * texture.width * texture.height) / std::max(area, 1e-6f));
 }
 
-bool TexturedTriangle::intersect(const Ray& ray, float &t) {
+// Texture coordinates of a hit from its barycentric coordinates
+glm::vec3 TexturedTriangle::textureCoordinates(float u, float v) const {
+    if (bottom) {
+        return (u * glm::vec3{0.0, 0.0, 0.0}) + (v * glm::vec3{0.0, 1.0, 0.0}) + ((1.0f - u - v) * glm::vec3{1.0, 1.0, 0.0});
+    } else {
+        return (u * glm::vec3{1.0, 0.0, 0.0}) + (v * glm::vec3{0.0, 0.0, 0.0}) + ((1.0f - u - v) * glm::vec3{1.0, 1.0, 0.0});
+    }
+}
 
-    glm::vec3 AB = v1 - v0;
-    glm::vec3 AC = v2 - v0;
-    glm::vec3 cramer_p = glm::cross(ray.vector, AC);
-    float det = glm::dot(AB, cramer_p);
-    
-    // Disregard triangle if triangle is backfacing
-    if (fabs(det) < 0.0000001) {
-        return false;
+// Texture under a hit, filtered to the ray's footprint there. The mip level
+// is the log2 of the texels across the footprint, which widens as the
+// surface turns away from the ray.
+glm::vec3 TexturedTriangle::albedo(const Ray& ray, const Intersection& collision) const {
+    glm::vec3 uv = textureCoordinates(collision.u, collision.v);
+
+    float lod = 0.0;
+    float footprint = ray.cone + (collision.t * ray.spread);
+    if (footprint > 0.0f) {
+        glm::vec3 face = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+        float facing = std::max(std::abs(glm::dot(face, ray.vector)), MIN_TEXTURE_FACING);
+        lod = lod_bias + glm::log2(footprint / facing);
     }
 
-    float inv_det = 1.0 / det;
+    return texture.sample(glm::vec2{uv.x, uv.y}, lod);
+}
 
-    glm::vec3 cramer_t = ray.origin - v0;
-    float u = glm::dot(cramer_t, cramer_p) * inv_det;
-    if (u < 0 || u > 1) {
-        return false;
+glm::vec3 TexturedTriangle::surface(const Ray& ray, const Intersection& collision, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Accelerator &accel) const {
+    glm::vec3 _color, lambert_color, specular_color;
+    lambert_color = specular_color = glm::vec3{0.0, 0.0, 0.0};
+
+    const glm::vec3 &point = collision.point;
+    glm::vec3 norm = this->surfaceNormal(collision, ray);
+    const float lambert = material->lambert;
+    const float specular = material->specular;
+
+    if (lambert) {
+        lambert_color = diffuseLight(point, norm, objects, lights, accel);
+        lambert_color *= albedo(ray, collision);
     }
 
-    glm::vec3 cramer_q = glm::cross(cramer_t, AB);
-    float v = glm::dot(ray.vector, cramer_q) * inv_det;
-    if (v < 0 || (u + v) > 1) {
-        return false;
+    if (specular) {
+        specular_color = reflection(ray, point, norm, objects, lights, accel);
     }
 
-    t = glm::dot(AC, cramer_q) * inv_det;
+    _color = (lambert_color * lambert) + (specular_color * specular);
 
-    if (bottom) {
-        UV[omp_get_thread_num()] = (u * glm::vec3{0.0, 0.0, 0.0}) + (v * glm::vec3{0.0, 1.0, 0.0}) + ((1.0f - u - v) * glm::vec3{1.0, 1.0, 0.0});
+    return _color;
+}
+
+/* SPHERE DATA */
+SphereData::SphereData(const Sphere& sphere) : center(sphere.center), radius(sphere.radius), shape(const_cast<Sphere*>(&sphere)), id(sphere.id) {}
+
+// from https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-sphere-intersection
+static bool solveQuadratic (const float &a, const float &b, const float &c, float &x0, float &x1) {
+    float discr = (b * b) - (4 * a * c);
+    if (discr < 0) {
+        return false;
+    } else if (discr == 0) {
+        x0 = x1 = -b/(2 * a);
     } else {
-        UV[omp_get_thread_num()] = (u * glm::vec3{1.0, 0.0, 0.0}) + (v * glm::vec3{0.0, 0.0, 0.0}) + ((1.0f - u - v) * glm::vec3{1.0, 1.0, 0.0});
+        float q = (b > 0) ? (-0.5 * (b + glm::sqrt(discr))) : (-0.5 * (b - glm::sqrt(discr)));
+        x0 = q / a;
+        x1 = c / q;
+    }
+
+    if (x0 > x1) {
+        std::swap(x0, x1);
     }
 
     return true;
 }
 
-glm::vec3 TexturedTriangle::surface(const Ray& ray, const glm::vec3& point, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Grid &grid) const {
-    glm::vec3 _color, lambert_color, specular_color;
-    lambert_color = specular_color = glm::vec3{0.0, 0.0, 0.0};
+// from https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/minimal-ray-tracer-rendering-spheres
+bool SphereData::intersect(const Ray &ray, float &t) const {
+    float t0, t1;
 
-    glm::vec3 norm = this->normal(point, ray);
+    glm::vec3 L = ray.origin - center;
+    float a = glm::dot(ray.vector, ray.vector);
+    float b = 2 * glm::dot(ray.vector, L);
+    float c = glm::dot(L, L) - (radius*radius);
 
-    if (lambert) {
-        for (auto &l : lights) {
+    if (!solveQuadratic(a, b, c, t0, t1)) {
+        return false;
+    }
 
-            if (l->visible(point + (norm * 0.01f), objects, grid, norm)) {
-                float contribution = glm::dot(glm::normalize(l->position - point), norm);
-                if (contribution > 0) {
-                    lambert_color += (l->color * contribution);
-                }
-            }
+    if (t0 > t1) {
+        std::swap(t0, t1);
+    }
+
+    if (t0 < 0) {
+        if (t1 < 0) {
+            return false;
         }
+        t0 = t1;
+    }
+
+    t = t0;
+
+    return true;
+}
+
+// SphereData::intersect for four rays at once
+void SphereData::intersectPacket(RayPacket& packet) const {
+    __m128 dx = _mm_loadu_ps(packet.dx);
+    __m128 dy = _mm_loadu_ps(packet.dy);
+    __m128 dz = _mm_loadu_ps(packet.dz);
+    __m128 lx = _mm_sub_ps(_mm_loadu_ps(packet.ox), _mm_set1_ps(center.x));
+    __m128 ly = _mm_sub_ps(_mm_loadu_ps(packet.oy), _mm_set1_ps(center.y));
+    __m128 lz = _mm_sub_ps(_mm_loadu_ps(packet.oz), _mm_set1_ps(center.z));
+
+    __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+    __m128 b = _mm_mul_ps(_mm_set1_ps(2.0), _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, lx), _mm_mul_ps(dy, ly)), _mm_mul_ps(dz, lz)));
+    __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz)), _mm_set1_ps(radius * radius));
+
+    __m128 discr = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_set1_ps(4.0), _mm_mul_ps(a, c)));
+    __m128 valid = _mm_cmpge_ps(discr, _mm_setzero_ps());
+
+    // Numerically stable roots as in solveQuadratic
+    __m128 root = _mm_sqrt_ps(_mm_max_ps(discr, _mm_setzero_ps()));
+    __m128 positive = _mm_cmpgt_ps(b, _mm_setzero_ps());
+    __m128 sum = _mm_or_ps(_mm_and_ps(positive, _mm_add_ps(b, root)), _mm_andnot_ps(positive, _mm_sub_ps(b, root)));
+    __m128 q = _mm_mul_ps(_mm_set1_ps(-0.5), sum);
+    __m128 x0 = _mm_div_ps(q, a);
+    __m128 x1 = _mm_div_ps(c, q);
+    __m128 t0 = _mm_min_ps(x0, x1);
+    __m128 t1 = _mm_max_ps(x0, x1);
+
+    // Use the far root when the ray starts inside the sphere
+    __m128 behind = _mm_cmplt_ps(t0, _mm_setzero_ps());
+    __m128 t = _mm_or_ps(_mm_and_ps(behind, t1), _mm_andnot_ps(behind, t0));
+
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(t, _mm_setzero_ps()));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_loadu_ps(packet.t)));
+    int mask = _mm_movemask_ps(valid) & packet.active;
+    if (mask) {
+        packet.record(mask, t, shape);
+    }
+}
+
+/* TRIANGLE DATA */
+TriangleData::TriangleData(const Triangle& triangle) :  v0(triangle.v0),
+                                                        e1(triangle.v1 - triangle.v0),
+                                                        e2(triangle.v2 - triangle.v0),
+                                                        shape(const_cast<Triangle*>(&triangle)),
+                                                        id(triangle.id) {}
 
-        // Get texture color
-        glm::ivec3 tex_coord{UV[omp_get_thread_num()] * glm::vec3{texture.width(), texture.height(), 0.0}};
-        glm::vec3 tex_color{texture(tex_coord.x, tex_coord.y, 0, 0), texture(tex_coord.x, tex_coord.y, 0, 1), texture(tex_coord.x, tex_coord.y, 0, 2)};
-        lambert_color *= tex_color/255.0f;
+TriangleData::TriangleData(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, Shape *s, int i) : v0(p0), e1(p1 - p0), e2(p2 - p0), shape(s), id(i) {}
+
+// From https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection
+bool TriangleData::intersect(const Ray& ray, float &t, float &u, float &v) const {
 
+    const glm::vec3 &AB = e1;
+    const glm::vec3 &AC = e2;
+    glm::vec3 cramer_p = glm::cross(ray.vector, AC);
+    float det = glm::dot(AB, cramer_p);
+    
+    // Disregard triangle if triangle is backfacing
+    if (fabs(det) < 0.0000001) {
+        return false;
     }
 
-    if (specular) {
-        glm::vec3 reflected_vec = glm::reflect(ray.vector, norm);
-        Ray reflected_ray{point + (reflected_vec * 0.01f), reflected_vec};
-        reflected_ray.depth = ray.depth + 1;
+    float inv_det = 1.0 / det;
 
-        specular_color = trace(reflected_ray, objects, lights, grid);
+    glm::vec3 cramer_t = ray.origin - v0;
+    u = glm::dot(cramer_t, cramer_p) * inv_det;
+    if (u < 0 || u > 1) {
+        return false;
     }
 
-    _color = (lambert_color * lambert) + (specular_color * specular);
+    glm::vec3 cramer_q = glm::cross(cramer_t, AB);
+    v = glm::dot(ray.vector, cramer_q) * inv_det;
+    if (v < 0 || (u + v) > 1) {
+        return false;
+    }
 
-    return _color;
-}
\ No newline at end of file
+    t = glm::dot(AC, cramer_q) * inv_det;
+
+    return true;
+}
+
+// TriangleData::intersect for four rays at once
+void TriangleData::intersectPacket(RayPacket& packet) const {
+    const glm::vec3 &AB = e1;
+    const glm::vec3 &AC = e2;
+
+    __m128 dx = _mm_loadu_ps(packet.dx);
+    __m128 dy = _mm_loadu_ps(packet.dy);
+    __m128 dz = _mm_loadu_ps(packet.dz);
+    __m128 ab_x = _mm_set1_ps(AB.x), ab_y = _mm_set1_ps(AB.y), ab_z = _mm_set1_ps(AB.z);
+    __m128 ac_x = _mm_set1_ps(AC.x), ac_y = _mm_set1_ps(AC.y), ac_z = _mm_set1_ps(AC.z);
+
+    __m128 p_x = _mm_sub_ps(_mm_mul_ps(dy, ac_z), _mm_mul_ps(ac_y, dz));
+    __m128 p_y = _mm_sub_ps(_mm_mul_ps(dz, ac_x), _mm_mul_ps(ac_z, dx));
+    __m128 p_z = _mm_sub_ps(_mm_mul_ps(dx, ac_y), _mm_mul_ps(ac_x, dy));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ab_x, p_x), _mm_mul_ps(ab_y, p_y)), _mm_mul_ps(ab_z, p_z));
+
+    // Disregard rays parallel to the triangle
+    __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    __m128 valid = _mm_cmpge_ps(abs_det, _mm_set1_ps(0.0000001));
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0), det);
+
+    __m128 t_x = _mm_sub_ps(_mm_loadu_ps(packet.ox), _mm_set1_ps(v0.x));
+    __m128 t_y = _mm_sub_ps(_mm_loadu_ps(packet.oy), _mm_set1_ps(v0.y));
+    __m128 t_z = _mm_sub_ps(_mm_loadu_ps(packet.oz), _mm_set1_ps(v0.z));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(t_x, p_x), _mm_mul_ps(t_y, p_y)), _mm_mul_ps(t_z, p_z)), inv_det);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, _mm_setzero_ps()), _mm_cmple_ps(u, _mm_set1_ps(1.0))));
+
+    __m128 q_x = _mm_sub_ps(_mm_mul_ps(t_y, ab_z), _mm_mul_ps(ab_y, t_z));
+    __m128 q_y = _mm_sub_ps(_mm_mul_ps(t_z, ab_x), _mm_mul_ps(ab_z, t_x));
+    __m128 q_z = _mm_sub_ps(_mm_mul_ps(t_x, ab_y), _mm_mul_ps(ab_x, t_y));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, q_x), _mm_mul_ps(dy, q_y)), _mm_mul_ps(dz, q_z)), inv_det);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, _mm_setzero_ps()), _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0))));
+
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ac_x, q_x), _mm_mul_ps(ac_y, q_y)), _mm_mul_ps(ac_z, q_z)), inv_det);
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(t, _mm_setzero_ps()));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_loadu_ps(packet.t)));
+
+    int mask = _mm_movemask_ps(valid) & packet.active;
+    if (mask) {
+        packet.record(mask, t, shape);
+    }
+}
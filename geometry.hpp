@@ -4,28 +4,35 @@
 #include <vector>
 #include <glm/vec3.hpp>
 #include "raytrace.hpp"
-#include "CImg.h"
+#include "bvh.hpp"
+#include "triangleblock.hpp"
+#include "texture.hpp"
 
 class Shape {
 public:
 
     glm::vec3 color;
-    float lambert;
-    float specular;
-    bool refractive;
-    float IoR;
+    const Material *material; // In the scene's material table
 
     bool model;
-    Intersection intersected_tri[4];
+    int id; // Index in the scene's object list, model triangles share their model's
 
     Shape();
     Shape(glm::vec3 color);
-    Shape(glm::vec3 color, float lam, float spec, bool refr, float ior);
+    Shape(glm::vec3 color, const Material *mat);
     virtual ~Shape();
 
-    virtual bool intersect(const Ray& ray, float &t) = 0;
-    virtual glm::vec3 surface(const Ray& ray, const glm::vec3& point, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Grid &grid) const;
+    virtual bool intersect(const Ray& ray, float &t) const = 0;
+    virtual bool intersectClosest(const Ray& ray, Intersection &collision) const;
+    virtual bool intersectPrimitive(const Ray& ray, int primitive, Intersection &collision) const;
+    virtual void intersectPacket(RayPacket& packet) const;
+    virtual bool occludes(const Ray& ray, float t_max) const;
+    virtual glm::vec3 surface(const Ray& ray, const Intersection& collision, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Accelerator &accel) const;
+    virtual glm::vec3 albedo(const Ray& ray, const Intersection& collision) const;
+    glm::vec3 diffuseLight(const glm::vec3& point, const glm::vec3& norm, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Accelerator &accel) const;
+    glm::vec3 reflection(const Ray& ray, const glm::vec3& point, const glm::vec3& norm, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Accelerator &accel) const;
     virtual glm::vec3 normal(const glm::vec3& point, const Ray& ray) const = 0;
+    virtual glm::vec3 surfaceNormal(const Intersection& collision, const Ray& ray) const;
     virtual glm::vec3 min() const = 0;
     virtual glm::vec3 max() const = 0;
 
@@ -41,17 +48,14 @@ public:
 
     Sphere(glm::vec3 ctr, float r);
     Sphere(glm::vec3 ctr, float r, glm::vec3 col);
-    Sphere(glm::vec3 ctr, float r, glm::vec3 col, float lam, float spec, bool refr, float ior);
+    Sphere(glm::vec3 ctr, float r, glm::vec3 col, const Material *mat);
 
-    bool intersect(const Ray& ray, float &t);
+    bool intersect(const Ray& ray, float &t) const;
+    void intersectPacket(RayPacket& packet) const override;
     glm::vec3 normal(const glm::vec3& point, const Ray& ray) const;
     glm::vec3 min() const;
     glm::vec3 max() const;
 
-private:
-
-    bool solveQuadratic (const float &a, const float &b, const float &c, float &x0, float &x1) const;
-
 };
 
 class Triangle : public Shape {
@@ -63,38 +67,59 @@ public:
 
     Triangle(glm::vec3 p1, glm::vec3 p2, glm::vec3 p3);
     Triangle(glm::vec3 p1, glm::vec3 p2, glm::vec3 p3, glm::vec3 col);
-    Triangle(glm::vec3 p1, glm::vec3 p2, glm::vec3 p3, glm::vec3 col, float lam, float spec, bool refr, float ior);
+    Triangle(glm::vec3 p1, glm::vec3 p2, glm::vec3 p3, glm::vec3 col, const Material *mat);
 
-    bool intersect(const Ray& ray, float &t);
+    bool intersect(const Ray& ray, float &t) const;
+    bool intersect(const Ray& ray, float &t, float &u, float &v) const;
+    bool intersectClosest(const Ray& ray, Intersection &collision) const override;
+    void intersectPacket(RayPacket& packet) const override;
     glm::vec3 normal(const glm::vec3& point, const Ray& ray) const;
     glm::vec3 min() const;
     glm::vec3 max() const;
 
 };
 
+// Texture lookups blur no further than for a surface seen this far from edge on
+const float MIN_TEXTURE_FACING = 0.05;
+
 class TexturedTriangle : public Triangle {
 public:
 
     bool bottom;
-    glm::vec3 UV[4];
-    cimg_library::CImg<float>& texture;
+    const Texture& texture;
+    float lod_bias; // Mip level of a footprint one unit across, seen head on
 
-    TexturedTriangle(glm::vec3 p1, glm::vec3 p2, glm::vec3 p3, float lam, float spec, bool refr, float ior, cimg_library::CImg<float>& tex, bool bot);
+    TexturedTriangle(glm::vec3 p1, glm::vec3 p2, glm::vec3 p3, const Material *mat, const Texture& tex, bool bot);
 
-    bool intersect(const Ray& ray, float &t) override;
-    glm::vec3 surface(const Ray& ray, const glm::vec3& point, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Grid &grid) const override;
+    glm::vec3 textureCoordinates(float u, float v) const;
+    glm::vec3 albedo(const Ray& ray, const Intersection& collision) const override;
+    glm::vec3 surface(const Ray& ray, const Intersection& collision, const std::vector<Shape*>& objects, const std::vector<Light*> &lights, Accelerator &accel) const override;
 };
 
+// Triangles sharing one vertex buffer, three indices each, all of the model's
+// material. A hit records the model, with the triangle as its primitive.
 class Model : public Shape {
 public:
 
     glm::vec3 minimum;
     glm::vec3 maximum;
-    std::vector<Triangle*> triangles;
+    std::vector<glm::vec3> vertices;
+    std::vector<glm::ivec3> indices; // Vertices of each triangle
+    std::vector<glm::vec3> normals; // For smooth shading, empty to shade each triangle flat
+    std::vector<glm::ivec3> normal_indices; // Normals at each triangle's corners, -1 where there are none
+    std::vector<TriangleBlock> blocks; // Triangles of each BVH leaf, which index into indices
+    BVH bvh;
 
     Model();
-    bool intersect(const Ray& ray, float &t);
+    Model(glm::vec3 col, const Material *mat);
+    void build();
+    bool intersect(const Ray& ray, float &t) const;
+    bool intersectClosest(const Ray& ray, Intersection &collision) const override;
+    bool intersectPrimitive(const Ray& ray, int primitive, Intersection &collision) const override;
+    void intersectPacket(RayPacket& packet) const override;
+    bool occludes(const Ray& ray, float t_max) const override;
     glm::vec3 normal(const glm::vec3& point, const Ray& ray) const;
+    glm::vec3 surfaceNormal(const Intersection& collision, const Ray& ray) const override;
     glm::vec3 min() const;
     glm::vec3 max() const;
 
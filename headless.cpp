@@ -0,0 +1,121 @@
+// Renders one frame of a level without SDL or a window and saves it to an
+// image file, for running the tracer in batch on machines without a display:
+//
+//   headless <level> --output=frame.bmp [--width=W] [--height=H]
+//            [--position=x,y,z] [--direction=x,y,z] [renderer options]
+//
+// The camera starts where scene.json puts it. The renderer options are the
+// ones the game takes, such as --aa=N and --accel=bvh.
+
+#define cimg_display 0
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+#include <glm/vec3.hpp>
+#include <glm/geometric.hpp>
+#include "CImg.h"
+
+#include "raytrace.hpp"
+#include "level.hpp"
+
+// Read "x,y,z" into v, false if it is not three numbers
+static bool parseVector(const char *s, glm::vec3 &v) {
+    return sscanf(s, "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
+}
+
+int main(int argc, char *argv[]) {
+    std::string level_path = "scene.json";
+    std::string output = "";
+    LevelOptions options;
+    glm::vec3 position, direction;
+    bool set_position = false;
+    bool set_direction = false;
+    for (int a = 1; a < argc; a++) {
+        if (options.parse(argv[a])) {
+            continue;
+        } else if (strncmp(argv[a], "--output=", 9) == 0) {
+            output = argv[a] + 9;
+        } else if (strncmp(argv[a], "--width=", 8) == 0) {
+            options.width = atoi(argv[a] + 8);
+        } else if (strncmp(argv[a], "--height=", 9) == 0) {
+            options.height = atoi(argv[a] + 9);
+        } else if (strncmp(argv[a], "--position=", 11) == 0) {
+            set_position = parseVector(argv[a] + 11, position);
+            if (!set_position) {
+                std::cout << "Expected --position=x,y,z" << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[a], "--direction=", 12) == 0) {
+            set_direction = parseVector(argv[a] + 12, direction) && glm::length(direction) > 0.0;
+            if (!set_direction) {
+                std::cout << "Expected --direction=x,y,z with some length" << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[a], "--", 2) != 0) {
+            level_path = std::string(argv[a]) + "/scene.json";
+        } else {
+            std::cout << "Unknown option " << argv[a] << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (output.empty() || options.width < 2 || options.height < 2) {
+        std::cout << "Usage: headless <level> --output=frame.bmp [--width=W] [--height=H] [--position=x,y,z] [--direction=x,y,z] [--aa=N] ..." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Previews are never rendered, but keep them a quarter of the size
+    options.preview_width = std::max(2, options.width / 4);
+    options.preview_height = std::max(2, options.height / 4);
+
+    Level level;
+    if (!level.load(level_path, options)) {
+        return EXIT_FAILURE;
+    }
+    Scene &scene = *level.scene;
+
+    if (set_position) {
+        scene.camera.origin = position;
+    }
+    if (set_direction) {
+        scene.camera.dir = glm::normalize(direction);
+    }
+    if (set_position || set_direction) {
+        scene.camera.placeSprite();
+    }
+
+    std::vector<uint32_t> pixels(scene.camera.WIDTH * scene.camera.HEIGHT);
+    ProgressiveFrame frame;
+    RenderStats stats = render(pixels.data(), scene, *level.accel, frame);
+
+    cimg_library::CImg<unsigned char> image(scene.camera.WIDTH, scene.camera.HEIGHT, 1, 3);
+    for (int y = 0; y < scene.camera.HEIGHT; y++) {
+        for (int x = 0; x < scene.camera.WIDTH; x++) {
+            uint32_t p = pixels[(y * scene.camera.WIDTH) + x];
+            image(x, y, 0, 0) = (p >> 16) & 0xFF;
+            image(x, y, 0, 1) = (p >> 8) & 0xFF;
+            image(x, y, 0, 2) = p & 0xFF;
+        }
+    }
+
+    try {
+        image.save(output.c_str());
+    } catch (cimg_library::CImgException &e) {
+        std::cout << "Failed to write " << output << ": " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Rendered " << scene.camera.WIDTH << "x" << scene.camera.HEIGHT << " with " << stats.samples_per_pixel << " samples per pixel in "
+              << stats.seconds << " seconds (" << stats.primary_rays / stats.seconds / 1000000.0 << " Mrays/s) to " << output << std::endl;
+    #ifdef TRAVERSAL_STATS
+    stats.traversal.print(std::cout, stats.primary_rays);
+    #endif
+
+    return EXIT_SUCCESS;
+}
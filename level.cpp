@@ -0,0 +1,868 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <assert.h>
+
+#include <glm/vec3.hpp>
+#include <glm/common.hpp>
+#include "rapidjson/document.h"
+
+#include "level.hpp"
+
+/* LEVEL OPTIONS CLASS */
+LevelOptions::LevelOptions() : width(640), height(480), preview_width(160), preview_height(120), aa(0), aa_threshold(DEFAULT_AA_THRESHOLD), tile_size(DEFAULT_TILE_SIZE), threads(0) {}
+
+// Read one --option=value renderer setting, false if arg is not one of them
+bool LevelOptions::parse(const char *arg) {
+    if (strncmp(arg, "--accel=", 8) == 0) {
+        accelerator = arg + 8;
+    } else if (strncmp(arg, "--packets=", 10) == 0) {
+        packets = arg + 10;
+    } else if (strncmp(arg, "--tile-size=", 12) == 0) {
+        tile_size = atoi(arg + 12);
+    } else if (strncmp(arg, "--threads=", 10) == 0) {
+        threads = atoi(arg + 10);
+    } else if (strncmp(arg, "--aa=", 5) == 0) {
+        aa = atoi(arg + 5);
+    } else if (strncmp(arg, "--adaptive=", 11) == 0) {
+        adaptive = arg + 11;
+    } else if (strncmp(arg, "--aa-threshold=", 15) == 0) {
+        aa_threshold = atof(arg + 15);
+    } else if (strncmp(arg, "--reproject=", 12) == 0) {
+        reproject = arg + 12;
+    } else if (strncmp(arg, "--heatmap=", 10) == 0) {
+        heatmap = arg + 10;
+    } else if (strncmp(arg, "--compiled=", 11) == 0) {
+        compiled = arg + 11;
+    } else if (strncmp(arg, "--mipmaps=", 10) == 0) {
+        mipmaps = arg + 10;
+    } else if (strncmp(arg, "--tonemap=", 10) == 0) {
+        tonemap = arg + 10;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/* LEVEL SETTINGS CLASS */
+LevelSettings::LevelSettings() : fov(0), sprite(false), AA(1), adaptive(-1), packets(-1), reproject(-1), grid(0, 0, 0) {}
+
+/* LEVEL CLASS */
+Level::Level() : scene(nullptr), accel(nullptr) {}
+
+Level::~Level() {
+    clear();
+}
+
+void Level::clear() {
+    // The scene frees its objects and lights with its arena
+    delete accel;
+    delete scene;
+    scene = nullptr;
+    accel = nullptr;
+
+    sources.clear();
+    settings = LevelSettings();
+}
+
+// Where compilescene puts the compiled form of a scene.json: beside it, as scene.bin
+std::string Level::compiledPath(const std::string& path) {
+    std::string base = path;
+    if (base.size() >= 5 && base.compare(base.size() - 5, 5, ".json") == 0) {
+        base.resize(base.size() - 5);
+    }
+    return base + ".bin";
+}
+
+// Build the scene from its compiled form if there is an up to date one, or
+// else from the scene.json file. False if neither can be read.
+bool Level::load(const std::string& path, const LevelOptions& options) {
+    clear();
+    if (options.compiled == "off" || !loadCompiled(compiledPath(path), options)) {
+        clear();
+        if (!loadJSON(path, options)) {
+            return false;
+        }
+
+        addSprite();
+        numberObjects();
+        chooseAccelerator(options);
+        buildAccelerator();
+    }
+
+    applySettings(options);
+
+    #ifdef DEBUG
+    std::cout << "Scene arena holds " << scene->arena.count() << " objects and lights in " << scene->arena.used() / 1024.0 << " KB of "
+              << scene->arena.reserved() / 1024.0 << " KB" << std::endl;
+    #endif
+
+    return true;
+}
+
+// Record a file the scene is read from, false if it does not exist. Missing
+// files are recorded too, so a scene compiled without them goes out of date
+// once they appear.
+bool Level::addSource(const std::string& file) {
+    SceneSource source;
+    bool found = source.read(file);
+    sources.push_back(source);
+    return found;
+}
+
+// Make the scene and place its camera as the settings say
+void Level::createScene(const LevelOptions& options, int num_objects, int num_lights) {
+    password = settings.password;
+    scene = new Scene{options.width, options.height, (float) settings.fov, num_objects, num_lights};
+
+    scene->camera.using_sprite = settings.sprite;
+
+    // Create a camera facing forward
+    scene->camera.setResolution(options.width, options.height, options.preview_width, options.preview_height);
+
+    // Move camera
+    scene->camera.move(settings.camera_position, settings.camera_point);
+}
+
+// Read the scene's objects, textures and lights from a scene.json file
+bool Level::loadJSON(const std::string& path, const LevelOptions& options) {
+    // Read scene file from json
+    int file_length = 0;
+    char *buff;
+    std::ifstream f = std::ifstream(path, std::ifstream::binary | std::ios::ate); // Read file from end
+
+    if (!f) {
+        std::cout << "Failed to read scene.json" << std::endl;
+        return false;
+    }
+
+    file_length = f.tellg();
+    buff = new char[file_length + 1];
+    f.seekg(0, f.beg);
+    f.read(buff, file_length);
+    buff[file_length] = '\0';
+    #ifdef DEBUG
+    std::cout << "Reading scene.json with length " << file_length << std::endl;
+    #endif
+
+    rapidjson::Document d;
+    d.Parse(buff);
+    delete[] buff;
+    assert(d.IsObject());
+
+    // Older scenes leave out the kinds of objects they do not use
+    rapidjson::Value &objects = d["objects"];
+    for (const char *kind : {"spheres", "triangles", "rectangles", "texturedRectangles", "models"}) {
+        if (!objects.HasMember(kind)) {
+            rapidjson::Value empty(rapidjson::kArrayType);
+            objects.AddMember(rapidjson::StringRef(kind), empty, d.GetAllocator());
+        }
+    }
+
+    addSource(path);
+
+    /* Settings */
+    settings.password = d["password"].GetString();
+    settings.accelerator = d.HasMember("accelerator") ? d["accelerator"].GetString() : "";
+    settings.fov = d["camera"]["fov"].GetFloat();
+    settings.camera_position = vec3{d["camera"]["x"].GetFloat(), d["camera"]["y"].GetFloat(), d["camera"]["z"].GetFloat()};
+    settings.camera_point = vec3{d["camera"]["toX"].GetFloat(), d["camera"]["toY"].GetFloat(), d["camera"]["toZ"].GetFloat()};
+    settings.sprite = d["camera"].HasMember("sprite") && d["camera"]["sprite"].GetBool();
+    settings.AA = d["AA"].GetInt();
+    settings.adaptive = d.HasMember("adaptiveAA") ? d["adaptiveAA"].GetBool() : -1;
+    settings.packets = d.HasMember("packets") ? d["packets"].GetBool() : -1;
+    settings.reproject = d.HasMember("reproject") ? d["reproject"].GetBool() : -1;
+    if (d.HasMember("grid")) {
+        settings.grid = glm::ivec3{d["grid"]["x"].GetInt(), d["grid"]["y"].GetInt(), d["grid"]["z"].GetInt()};
+    }
+
+    /* Create scene */
+    int num_objects = d["objects"]["spheres"].Size() + d["objects"]["triangles"].Size() + (d["objects"]["rectangles"].Size()*2) + (d["objects"]["texturedRectangles"].Size()*2);
+    int num_lights = d["lights"].Size();
+    createScene(options, num_objects, num_lights);
+
+    // Objects point into the material table, so it is filled before any of
+    // them. The last entry is the camera sprite's.
+    for (auto &m : d["materials"].GetArray()) {
+        scene->materials.push_back(Material{m["lambert"].GetFloat(), m["specular"].GetFloat(), m["refractive"].GetBool(), m["IoR"].GetFloat()});
+    }
+    scene->materials.push_back(Material());
+
+    // Get sphere objects from json document
+    int i = 0;
+    glm::vec3 ctr;
+    float rad;
+    for (auto &s : d["objects"]["spheres"].GetArray()) {
+        ctr = vec3{s["x"].GetFloat(), s["y"].GetFloat(), s["z"].GetFloat()};
+        rad = s["radius"].GetFloat();
+        Sphere *sph = scene->arena.create<Sphere>(ctr, rad,
+                                                  vec3{s["r"].GetFloat(), s["g"].GetFloat(), s["b"].GetFloat()},
+                                                  &scene->materials[s["material"].GetInt()]);
+        scene->objects[i++] = sph;
+    }
+
+    // Get triangle objects from json document
+    glm::vec3 p1;
+    glm::vec3 p2;
+    glm::vec3 p3;
+    for (auto &t : d["objects"]["triangles"].GetArray()) {
+        p1 = vec3{t["v1"]["x"].GetFloat(), t["v1"]["y"].GetFloat(), t["v1"]["z"].GetFloat()};
+        p2 = vec3{t["v2"]["x"].GetFloat(), t["v2"]["y"].GetFloat(), t["v2"]["z"].GetFloat()};
+        p3 = vec3{t["v3"]["x"].GetFloat(), t["v3"]["y"].GetFloat(), t["v3"]["z"].GetFloat()};
+        Triangle *tri = scene->arena.create<Triangle>(p1, p2, p3,
+                                                      vec3{t["r"].GetFloat(), t["g"].GetFloat(), t["b"].GetFloat()},
+                                                      &scene->materials[t["material"].GetInt()]);
+        scene->objects[i++] = tri;
+    }
+
+    // Create rectangles (an easier way to place geometry)
+    for (auto &t : d["objects"]["rectangles"].GetArray()) {
+        // Create Triangle 1
+        p1 = vec3{t["bottomright"]["x"].GetFloat(), t["bottomright"]["y"].GetFloat(), t["bottomright"]["z"].GetFloat()};
+        p2 = vec3{t["topleft"]["x"].GetFloat(), t["topleft"]["y"].GetFloat(), t["topleft"]["z"].GetFloat()};
+        p3 = vec3{t["bottomleft"]["x"].GetFloat(), t["bottomleft"]["y"].GetFloat(), t["bottomleft"]["z"].GetFloat()};
+        Triangle *tri1 = scene->arena.create<Triangle>(p1, p2, p3,
+                                                       vec3{t["r"].GetFloat(), t["g"].GetFloat(), t["b"].GetFloat()},
+                                                       &scene->materials[t["material"].GetInt()]);
+        scene->objects[i++] = tri1;
+
+        // Create Triangle 2
+        p1 = vec3{t["bottomright"]["x"].GetFloat(), t["bottomright"]["y"].GetFloat(), t["bottomright"]["z"].GetFloat()};
+        p2 = vec3{t["topright"]["x"].GetFloat(), t["topright"]["y"].GetFloat(), t["topright"]["z"].GetFloat()};
+        p3 = vec3{t["topleft"]["x"].GetFloat(), t["topleft"]["y"].GetFloat(), t["topleft"]["z"].GetFloat()};
+        Triangle *tri2 = scene->arena.create<Triangle>(p1, p2, p3,
+                                                       vec3{t["r"].GetFloat(), t["g"].GetFloat(), t["b"].GetFloat()},
+                                                       &scene->materials[t["material"].GetInt()]);
+        scene->objects[i++] = tri2;
+    }
+
+    // Load Textures, and the camera sprite texture last
+    std::vector<std::string> texture_files;
+    for (auto &t : d["textures"].GetArray()) {
+        texture_files.push_back(t.GetString());
+    }
+    texture_files.push_back("textures/robot.bmp");
+
+    for (auto &file : texture_files) {
+        addSource(file);
+        try {
+            scene->textures.push_back(Texture::load(file));
+        } catch (cimg_library::CImgException &e) {
+            std::cout << "Failed to load texture " << file << std::endl;
+            return false;
+        }
+    }
+
+
+    // Create textured rectangles
+    for (auto &t : d["objects"]["texturedRectangles"].GetArray()) {
+        // Create Triangle 1
+        p1 = vec3{t["bottomright"]["x"].GetFloat(), t["bottomright"]["y"].GetFloat(), t["bottomright"]["z"].GetFloat()};
+        p2 = vec3{t["topleft"]["x"].GetFloat(), t["topleft"]["y"].GetFloat(), t["topleft"]["z"].GetFloat()};
+        p3 = vec3{t["bottomleft"]["x"].GetFloat(), t["bottomleft"]["y"].GetFloat(), t["bottomleft"]["z"].GetFloat()};
+        TexturedTriangle *tri1 = scene->arena.create<TexturedTriangle>(p1, p2, p3,
+                                                                       &scene->materials[t["material"].GetInt()],
+                                                                       *scene->textures[t["texture"].GetInt()], true);
+        scene->objects[i++] = tri1;
+
+        // Create Triangle 2
+        p1 = vec3{t["bottomright"]["x"].GetFloat(), t["bottomright"]["y"].GetFloat(), t["bottomright"]["z"].GetFloat()};
+        p2 = vec3{t["topright"]["x"].GetFloat(), t["topright"]["y"].GetFloat(), t["topright"]["z"].GetFloat()};
+        p3 = vec3{t["topleft"]["x"].GetFloat(), t["topleft"]["y"].GetFloat(), t["topleft"]["z"].GetFloat()};
+        TexturedTriangle *tri2 = scene->arena.create<TexturedTriangle>(p1, p2, p3,
+                                                                       &scene->materials[t["material"].GetInt()],
+                                                                       *scene->textures[t["texture"].GetInt()], false);
+        scene->objects[i++] = tri2;
+    }
+
+    // Get object models from json document
+    glm::vec3 model_color, model_location;
+    for (auto &m : d["objects"]["models"].GetArray()) {
+        model_color = vec3{m["r"].GetFloat(), m["g"].GetFloat(), m["b"].GetFloat()};
+        model_location = vec3{m["x"].GetFloat(), m["y"].GetFloat(), m["z"].GetFloat()};
+        addSource(m["filename"].GetString());
+        ::load( scene->objects, scene->arena, m["filename"].GetString(),
+                m["scale"].GetFloat(),
+                model_location,
+                model_color,
+                &scene->materials[m["material"].GetInt()],
+                m.HasMember("smooth") && m["smooth"].GetBool());
+    }
+
+    // Get scene lights from json document
+    i = 0;
+    for (auto &l : d["lights"].GetArray()) {
+        Light *lgt = scene->arena.create<Light>(vec3{l["x"].GetFloat(), l["y"].GetFloat(), l["z"].GetFloat()},
+                                                vec3{l["r"].GetFloat(), l["g"].GetFloat(), l["b"].GetFloat()});
+        scene->lights[i++] = lgt;
+    }
+
+    return true;
+}
+
+// Create the camera sprite billboard, from the last texture
+void Level::addSprite() {
+    if (scene->camera.using_sprite) {
+        // Create Triangle 1
+        glm::vec3 right = scene->camera.rightVector();
+        glm::vec3 up = scene->camera.upVector(right);
+        //// Bottom Right
+        glm::vec3 p1 = scene->camera.origin + (2.0f*right) + (2.0f*up) - (0.1f * scene->camera.dir);
+        //// Top Left
+        glm::vec3 p2 = scene->camera.origin - (2.0f*right) - (2.0f*up) - (0.1f * scene->camera.dir);
+        //// Bottom Left
+        glm::vec3 p3 = scene->camera.origin - (2.0f*right) + (2.0f*up) - (0.1f * scene->camera.dir);
+        TexturedTriangle *tri1 = scene->arena.create<TexturedTriangle>(p1, p2, p3, &scene->materials.back(), *scene->textures.back(), true);
+        scene->objects.push_back(tri1);
+
+        // Create Triangle 2
+        //// Bottom Right
+        p1 = scene->camera.origin + (2.0f*right) + (2.0f*up) - (0.1f * scene->camera.dir);
+        //// Top Right
+        p2 = scene->camera.origin + (2.0f*right) - (2.0f*up) - (0.1f * scene->camera.dir);
+        //// Top Left
+        p3 = scene->camera.origin - (2.0f*right) - (2.0f*up) - (0.1f * scene->camera.dir);
+        TexturedTriangle *tri2 = scene->arena.create<TexturedTriangle>(p1, p2, p3, &scene->materials.back(), *scene->textures.back(), false);
+
+        scene->objects.push_back(tri2);
+
+        scene->camera.sprite_top = tri1;
+        scene->camera.sprite_bottom = tri2;
+    }
+}
+
+// Number objects for per-ray bookkeeping in the acceleration structures
+void Level::numberObjects() {
+    for (int o = 0; o < (int) scene->objects.size(); o++) {
+        scene->objects[o]->id = o;
+    }
+}
+
+// The camera sprite follows the camera, so it is kept out of the static structures
+std::vector<Shape*> Level::dynamicObjects() const {
+    std::vector<Shape*> dynamic;
+    if (scene->camera.using_sprite) {
+        dynamic.push_back(scene->camera.sprite_top);
+        dynamic.push_back(scene->camera.sprite_bottom);
+    }
+    return dynamic;
+}
+
+// Choose the acceleration structure, grid unless the command line or scene says otherwise
+void Level::chooseAccelerator(const LevelOptions& options) {
+    accelerator = options.accelerator;
+    if (accelerator.empty()) {
+        accelerator = settings.accelerator.empty() ? "grid" : settings.accelerator;
+    }
+}
+
+void Level::buildAccelerator() {
+    std::vector<Shape*> dynamic = dynamicObjects();
+
+    if (accelerator == "bvh") {
+        SceneBVH *bvh = new SceneBVH();
+        bvh->dynamic = dynamic;
+        bvh->build(scene->objects);
+        accel = bvh;
+
+        #ifdef DEBUG
+        std::cout << "Created scene BVH over " << bvh->objects.size() << " objects in " << bvh->bvh.build_time << " ms: "
+                  << bvh->bvh.nodes.size() << " nodes, depth " << bvh->bvh.depth << ", SAH cost " << bvh->bvh.cost << std::endl;
+        #endif
+    } else {
+        // Find the scene bounding box
+        glm::vec3 scene_min{10000.0, 10000.0, 10000.0};
+        glm::vec3 scene_max{-10000.0, -10000.0, -10000.0};
+        for (auto o : scene->objects) {
+            if (std::find(dynamic.begin(), dynamic.end(), o) == dynamic.end()) {
+                scene_min = glm::min(scene_min, o->min());
+                scene_max = glm::max(scene_max, o->max());
+            }
+        }
+
+        // Fit the grid to the scene, padded slightly so boundary objects fall inside
+        glm::vec3 padding = (scene_max - scene_min) * 0.001f + 0.001f;
+        glm::vec3 grid_min = scene_min - padding;
+        glm::vec3 grid_max = scene_max + padding;
+        glm::vec3 grid_size = grid_max - grid_min;
+
+        // "fixed-grid" keeps the hand tuned cell counts from scene.json for comparison
+        glm::ivec3 dimensions;
+        if (accelerator == "fixed-grid" && settings.grid.x > 0) {
+            dimensions = settings.grid;
+        } else {
+            dimensions = Grid::resolution(grid_size, scene->objects.size() - dynamic.size());
+        }
+
+        Grid *grid = new Grid{grid_size, dimensions, grid_min, grid_max};
+        grid->dynamic = dynamic;
+        grid->fill(scene->objects);
+        accel = grid;
+
+        #ifdef DEBUG
+        grid->printStats();
+        #endif
+    }
+}
+
+void Level::applySettings(const LevelOptions& options) {
+    // Anti-Aliasing
+    scene->AA = (options.aa > 0) ? options.aa : settings.AA;
+    if (options.adaptive.empty()) {
+        scene->adaptive = (settings.adaptive == 1);
+    } else {
+        scene->adaptive = (options.adaptive != "off");
+    }
+    scene->aa_threshold = options.aa_threshold;
+
+    // Trace primary rays in packets unless the command line or scene says otherwise
+    if (options.packets.empty()) {
+        scene->packets = (settings.packets != 0);
+    } else {
+        scene->packets = (options.packets != "off");
+    }
+
+    // Reuse the last preview's shading unless the command line or scene says otherwise
+    if (options.reproject.empty()) {
+        scene->reproject = (settings.reproject != 0);
+    } else {
+        scene->reproject = (options.reproject != "off");
+    }
+    scene->tile_size = options.tile_size;
+    scene->threads = options.threads;
+    scene->mipmaps = (options.mipmaps != "off");
+    scene->tonemap = (options.tonemap == "reinhard") ? TONEMAP_REINHARD : TONEMAP_FILMIC;
+
+    // Show what each pixel costs instead of its color
+    if (options.heatmap == "cells") {
+        scene->heatmap = HEATMAP_CELLS;
+    } else if (options.heatmap == "tests") {
+        scene->heatmap = HEATMAP_TESTS;
+    } else if (options.heatmap == "shadows") {
+        scene->heatmap = HEATMAP_SHADOW_RAYS;
+    } else if (options.heatmap == "time") {
+        scene->heatmap = HEATMAP_TIME;
+    }
+
+    #ifndef TRAVERSAL_STATS
+    if (scene->heatmap != HEATMAP_OFF && scene->heatmap != HEATMAP_TIME) {
+        std::cout << "Counting " << options.heatmap << " needs a build with -DTRAVERSAL_STATS, showing time instead" << std::endl;
+        scene->heatmap = HEATMAP_TIME;
+    }
+    #endif
+}
+
+// Write the scene, less the camera sprite, and its acceleration structure as a
+// compiled scene. False if it cannot be written.
+bool Level::save(const std::string& path) const {
+    SceneWriter out;
+    out.put(SCENE_CACHE_MAGIC);
+    out.put(SCENE_CACHE_VERSION);
+    out.put((uint32_t) sizeof(BVHNode));
+    out.put((uint32_t) sizeof(TriangleBlock));
+    out.put((uint32_t) TRIANGLE_BLOCK_SIZE);
+
+    out.put((uint32_t) sources.size());
+    for (auto &source : sources) {
+        out.putString(source.path);
+        out.put(source.size);
+        out.put(source.modified);
+    }
+
+    out.putString(settings.password);
+    out.putString(settings.accelerator);
+    out.put(settings.fov);
+    out.put(settings.camera_position);
+    out.put(settings.camera_point);
+    out.put((int) settings.sprite);
+    out.put(settings.AA);
+    out.put(settings.adaptive);
+    out.put(settings.packets);
+    out.put(settings.reproject);
+    out.put(settings.grid);
+
+    out.put((uint32_t) scene->textures.size());
+    for (auto &texture : scene->textures) {
+        out.putString(texture->path);
+        out.put(glm::ivec2{texture->width, texture->height});
+        out.putArray(texture->levels.data(), texture->levels.size());
+        out.putArray(texture->texels.data(), texture->texels.size());
+    }
+
+    // The sprite is added after every other object, so the rest keep their ids
+    int num_objects = scene->objects.size() - dynamicObjects().size();
+    std::vector<CompiledObject> objects(num_objects);
+    std::vector<Model*> models;
+    for (int o = 0; o < num_objects; o++) {
+        Shape *shape = scene->objects[o];
+        CompiledObject &c = objects[o];
+
+        if (Model *model = dynamic_cast<Model*>(shape)) {
+            c.kind = COMPILED_MODEL;
+            c.model = models.size();
+            models.push_back(model);
+        } else if (Sphere *sphere = dynamic_cast<Sphere*>(shape)) {
+            c.kind = COMPILED_SPHERE;
+            c.v0 = sphere->center;
+            c.v1.x = sphere->radius;
+        } else if (TexturedTriangle *triangle = dynamic_cast<TexturedTriangle*>(shape)) {
+            c.kind = COMPILED_TEXTURED_TRIANGLE;
+            c.v0 = triangle->v0;
+            c.v1 = triangle->v1;
+            c.v2 = triangle->v2;
+            c.texture = -1;
+            for (int t = 0; t < (int) scene->textures.size(); t++) {
+                if (scene->textures[t].get() == &triangle->texture) {
+                    c.texture = t;
+                }
+            }
+            c.bottom = triangle->bottom;
+        } else if (Triangle *triangle = dynamic_cast<Triangle*>(shape)) {
+            c.kind = COMPILED_TRIANGLE;
+            c.v0 = triangle->v0;
+            c.v1 = triangle->v1;
+            c.v2 = triangle->v2;
+        }
+
+        c.color = shape->color;
+        c.material = shape->material - scene->materials.data();
+    }
+    out.putArray(scene->materials.data(), scene->materials.size());
+    out.putArray(objects.data(), objects.size());
+
+    // Model meshes with triangles in BVH order, and the hierarchy and blocks built over them
+    out.put((uint32_t) models.size());
+    for (auto model : models) {
+        out.put(model->minimum);
+        out.put(model->maximum);
+        out.put(glm::ivec2{model->bvh.leaves, model->bvh.depth});
+        out.put(model->bvh.cost);
+        out.putArray(model->vertices.data(), model->vertices.size());
+        out.putArray(model->indices.data(), model->indices.size());
+        out.putArray(model->normals.data(), model->normals.size());
+        out.putArray(model->normal_indices.data(), model->normal_indices.size());
+        out.putArray(model->bvh.nodes.data(), model->bvh.nodes.size());
+        out.putArray(model->blocks.data(), model->blocks.size());
+    }
+
+    std::vector<glm::vec3> lights;
+    for (auto l : scene->lights) {
+        lights.push_back(l->position);
+        lights.push_back(l->color);
+    }
+    out.putArray(lights.data(), lights.size());
+
+    // The acceleration structure as the ids in each grid cell or BVH leaf
+    std::vector<int> counts, ids;
+    out.putString(accelerator);
+    if (Grid *grid = dynamic_cast<Grid*>(accel)) {
+        for (auto &range : grid->cell_ranges) {
+            int first = ids.size();
+            grid->primitives.ids(range, ids);
+            counts.push_back(ids.size() - first);
+        }
+
+        out.put(grid->size);
+        out.put(grid->dimensions);
+        out.put(grid->min);
+        out.put(grid->max);
+    } else if (SceneBVH *bvh = dynamic_cast<SceneBVH*>(accel)) {
+        for (auto &range : bvh->leaf_ranges) {
+            int first = ids.size();
+            bvh->primitives.ids(range, ids);
+            counts.push_back(ids.size() - first);
+        }
+
+        out.put(glm::ivec2{bvh->bvh.leaves, bvh->bvh.depth});
+        out.put(bvh->bvh.cost);
+        out.putArray(bvh->bvh.nodes.data(), bvh->bvh.nodes.size());
+    }
+    out.putArray(counts.data(), counts.size());
+    out.putArray(ids.data(), ids.size());
+
+    return out.save(path);
+}
+
+// Rebuild the scene from a compiled scene, false if there is none or it is
+// out of date, damaged or from another version
+bool Level::loadCompiled(const std::string& path, const LevelOptions& options) {
+    #ifdef DEBUG
+    auto start = std::chrono::high_resolution_clock::now();
+    #endif
+
+    MappedFile compiled;
+    if (!compiled.open(path)) {
+        #ifdef DEBUG
+        std::cout << "No compiled scene at " << path << std::endl;
+        #endif
+        return false;
+    }
+    SceneReader in(compiled.data, compiled.size);
+
+    if (in.get<uint32_t>() != SCENE_CACHE_MAGIC || in.get<uint32_t>() != SCENE_CACHE_VERSION ||
+        in.get<uint32_t>() != sizeof(BVHNode) || in.get<uint32_t>() != sizeof(TriangleBlock) || in.get<uint32_t>() != TRIANGLE_BLOCK_SIZE) {
+        std::cout << path << " was compiled by another version, reading the scene instead" << std::endl;
+        return false;
+    }
+
+    uint32_t num_sources = in.get<uint32_t>();
+    for (uint32_t s = 0; s < num_sources && in.ok; s++) {
+        SceneSource source, current;
+        source.path = in.getString();
+        source.size = in.get<int64_t>();
+        source.modified = in.get<int64_t>();
+        current.read(source.path);
+        if (current.size != source.size || current.modified != source.modified) {
+            std::cout << path << " is out of date with " << source.path << ", reading the scene instead" << std::endl;
+            return false;
+        }
+        sources.push_back(source);
+    }
+
+    settings.password = in.getString();
+    settings.accelerator = in.getString();
+    settings.fov = in.get<int>();
+    settings.camera_position = in.get<glm::vec3>();
+    settings.camera_point = in.get<glm::vec3>();
+    settings.sprite = in.get<int>();
+    settings.AA = in.get<int>();
+    settings.adaptive = in.get<int>();
+    settings.packets = in.get<int>();
+    settings.reproject = in.get<int>();
+    settings.grid = in.get<glm::ivec3>();
+
+    // Textures another level has already loaded are shared, the rest are
+    // copied out with their mipmaps ready
+    std::vector<std::shared_ptr<Texture>> textures;
+    uint32_t num_textures = in.get<uint32_t>();
+    for (uint32_t t = 0; t < num_textures && in.ok; t++) {
+        std::string file = in.getString();
+        glm::ivec2 size = in.get<glm::ivec2>();
+        std::shared_ptr<Texture> texture = Texture::find(file);
+        if (texture != nullptr) {
+            uint32_t count;
+            in.getArray<TextureLevel>(count);
+            in.getArray<uint32_t>(count);
+        } else {
+            texture = std::make_shared<Texture>();
+            texture->path = file;
+            texture->width = size.x;
+            texture->height = size.y;
+            in.getArray(texture->levels);
+            in.getArray(texture->texels);
+            if (!texture->valid()) {
+                in.ok = false;
+                break;
+            }
+            Texture::share(texture);
+        }
+        textures.push_back(texture);
+    }
+
+    std::vector<Material> materials;
+    in.getArray(materials);
+    if (materials.empty()) {
+        in.ok = false;
+    }
+
+    uint32_t num_objects;
+    const CompiledObject *objects = in.getArray<CompiledObject>(num_objects);
+    uint32_t num_models = in.get<uint32_t>();
+
+    std::vector<glm::vec3> lights;
+    if (in.ok) {
+        createScene(options, num_objects, 0);
+        scene->textures.swap(textures);
+        scene->materials.swap(materials);
+    }
+
+    for (uint32_t m = 0, o = 0; o < num_objects && in.ok; o++) {
+        const CompiledObject &c = objects[o];
+        if (c.material < 0 || c.material >= (int) scene->materials.size()) {
+            in.ok = false;
+            break;
+        }
+        const Material *material = &scene->materials[c.material];
+
+        if (c.kind == COMPILED_SPHERE) {
+            scene->objects[o] = scene->arena.create<Sphere>(c.v0, c.v1.x, c.color, material);
+        } else if (c.kind == COMPILED_TRIANGLE) {
+            scene->objects[o] = scene->arena.create<Triangle>(c.v0, c.v1, c.v2, c.color, material);
+        } else if (c.kind == COMPILED_TEXTURED_TRIANGLE && c.texture >= 0 && c.texture < (int) scene->textures.size()) {
+            scene->objects[o] = scene->arena.create<TexturedTriangle>(c.v0, c.v1, c.v2, material, *scene->textures[c.texture], (bool) c.bottom);
+        } else if (c.kind == COMPILED_MODEL && c.model == (int) m && m++ < num_models) {
+            Model *model = scene->arena.create<Model>(c.color, material);
+            scene->objects[o] = model;
+
+            model->minimum = in.get<glm::vec3>();
+            model->maximum = in.get<glm::vec3>();
+            glm::ivec2 shape = in.get<glm::ivec2>();
+            model->bvh.leaves = shape.x;
+            model->bvh.depth = shape.y;
+            model->bvh.cost = in.get<float>();
+            model->bvh.leaf_size = TRIANGLE_BLOCK_SIZE;
+
+            in.getArray(model->vertices);
+            in.getArray(model->indices);
+            in.getArray(model->normals);
+            in.getArray(model->normal_indices);
+            in.getArray(model->bvh.nodes);
+            in.getArray(model->blocks);
+
+            for (auto &f : model->indices) {
+                if (std::min({f.x, f.y, f.z}) < 0 || std::max({f.x, f.y, f.z}) >= (int) model->vertices.size()) {
+                    in.ok = false;
+                }
+            }
+            for (auto &n : model->normal_indices) {
+                if (std::min({n.x, n.y, n.z}) < -1 || std::max({n.x, n.y, n.z}) >= (int) model->normals.size()) {
+                    in.ok = false;
+                }
+            }
+            if (!model->normal_indices.empty() && model->normal_indices.size() != model->indices.size()) {
+                in.ok = false;
+            }
+            for (auto &block : model->blocks) {
+                if (block.count < 0 || block.count > TRIANGLE_BLOCK_SIZE) {
+                    in.ok = false;
+                    break;
+                }
+                for (int l = 0; l < block.count; l++) {
+                    if (block.index[l] < 0 || block.index[l] >= (int) model->indices.size()) {
+                        in.ok = false;
+                    }
+                }
+            }
+            int leaves;
+            if (!model->bvh.valid(model->blocks.size(), leaves)) {
+                in.ok = false;
+            }
+        } else {
+            in.ok = false;
+        }
+    }
+
+    in.getArray(lights);
+    if (!in.ok) {
+        std::cout << path << " is damaged, reading the scene instead" << std::endl;
+        return false;
+    }
+    for (size_t l = 0; l + 1 < lights.size(); l += 2) {
+        scene->lights.push_back(scene->arena.create<Light>(lights[l], lights[l + 1]));
+    }
+
+    addSprite();
+    numberObjects();
+
+    // Use the compiled acceleration structure if it is the kind asked for
+    chooseAccelerator(options);
+    std::string compiled_accelerator = in.getString();
+    if (accelerator != compiled_accelerator || !restoreAccelerator(in, compiled_accelerator)) {
+        buildAccelerator();
+    }
+
+    #ifdef DEBUG
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "Loaded " << path << " in " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0 << " ms: "
+              << scene->objects.size() << " objects, " << scene->textures.size() << " textures, " << accelerator
+              << (accelerator == compiled_accelerator ? " as compiled" : " rebuilt") << std::endl;
+    #endif
+
+    return true;
+}
+
+// Place the scene's objects into a grid or BVH as they were compiled, false
+// if the compiled data does not fit the scene
+bool Level::restoreAccelerator(SceneReader& in, const std::string& kind) {
+    Grid *grid = nullptr;
+    SceneBVH *bvh = nullptr;
+    glm::vec3 size, grid_min, grid_max;
+    glm::ivec3 dimensions;
+    if (kind == "grid" || kind == "fixed-grid") {
+        size = in.get<glm::vec3>();
+        dimensions = in.get<glm::ivec3>();
+        grid_min = in.get<glm::vec3>();
+        grid_max = in.get<glm::vec3>();
+        if (!in.ok || dimensions.x < 1 || dimensions.y < 1 || dimensions.z < 1) {
+            return false;
+        }
+    } else if (kind == "bvh") {
+        bvh = new SceneBVH();
+        glm::ivec2 shape = in.get<glm::ivec2>();
+        bvh->bvh.leaves = shape.x;
+        bvh->bvh.depth = shape.y;
+        bvh->bvh.cost = in.get<float>();
+        in.getArray(bvh->bvh.nodes);
+        accel = bvh;
+    } else {
+        return false;
+    }
+
+    std::vector<int> counts, ids;
+    in.getArray(counts);
+    in.getArray(ids);
+
+    // The grid is only made once its cells are known to match the counts, so
+    // damaged dimensions cannot ask for more cells than the file holds.
+    // Dividing rather than multiplying them out cannot overflow.
+    size_t cells = counts.size();
+    if (bvh == nullptr && in.ok && cells % dimensions.x == 0 && (cells / dimensions.x) % dimensions.y == 0 &&
+        cells / dimensions.x / dimensions.y == (size_t) dimensions.z) {
+        grid = new Grid{size, dimensions, grid_min, grid_max};
+        accel = grid;
+    }
+    if (!in.ok || accel == nullptr) {
+        delete accel;
+        accel = nullptr;
+        return false;
+    }
+    accel->dynamic = dynamicObjects();
+
+    std::vector<Shape*> shapes;
+    for (int c = 0, i = 0; c < (int) counts.size(); c++) {
+        shapes.clear();
+        if (counts[c] < 0 || counts[c] > (int) ids.size() - i) {
+            delete accel;
+            accel = nullptr;
+            return false;
+        }
+        for (int end = i + counts[c]; i < end; i++) {
+            if (ids[i] < 0 || ids[i] >= (int) scene->objects.size()) {
+                delete accel;
+                accel = nullptr;
+                return false;
+            }
+            shapes.push_back(scene->objects[ids[i]]);
+        }
+
+        if (grid != nullptr) {
+            grid->cells[c] = shapes;
+        } else {
+            bvh->leaf_ranges.push_back(bvh->primitives.add(shapes.data(), shapes.size()));
+            bvh->objects.insert(bvh->objects.end(), shapes.begin(), shapes.end());
+        }
+    }
+
+    // Every leaf must have its range of objects
+    int leaves;
+    if (bvh != nullptr && (!bvh->bvh.valid(bvh->leaf_ranges.size(), leaves) || leaves != (int) bvh->leaf_ranges.size())) {
+        delete accel;
+        accel = nullptr;
+        return false;
+    }
+    if (grid != nullptr) {
+        grid->pack();
+    }
+
+    #ifdef DEBUG
+    if (grid != nullptr) {
+        grid->printStats();
+    }
+    #endif
+
+    return true;
+}
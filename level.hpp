@@ -0,0 +1,95 @@
+#ifndef __LEVEL_HPP__
+#define __LEVEL_HPP__
+
+#include <string>
+#include <vector>
+#include <glm/vec3.hpp>
+#include "raytrace.hpp"
+#include "geometry.hpp"
+#include "loader.hpp"
+#include "compiledscene.hpp"
+
+// Settings that override a level's scene.json, from the command line. Empty
+// strings and zeros leave the choice to the scene or the defaults.
+class LevelOptions {
+public:
+
+    int width, height;
+    int preview_width, preview_height;
+    std::string accelerator;
+    std::string packets;
+    std::string adaptive;
+    std::string reproject;
+    std::string heatmap;
+    std::string compiled; // "off" to read scene.json even where a compiled scene exists
+    std::string mipmaps; // "off" to sample textures at full size however far away they are
+    std::string tonemap;
+    int aa;
+    float aa_threshold;
+    int tile_size;
+    int threads;
+
+    LevelOptions();
+
+    bool parse(const char *arg);
+
+};
+
+// What a scene.json sets besides its objects and lights
+class LevelSettings {
+public:
+
+    std::string password;
+    std::string accelerator; // Empty to leave it to the command line or the default
+    int fov;
+    glm::vec3 camera_position;
+    glm::vec3 camera_point;
+    bool sprite;
+    int AA;
+    int adaptive, packets, reproject; // 0 or 1, -1 where the scene leaves them out
+    glm::ivec3 grid; // Cell counts for fixed-grid, zero if the scene has none
+
+    LevelSettings();
+
+};
+
+// The scene described by a level's scene.json and the structure it is traced
+// through. Both are owned by the level.
+class Level {
+public:
+
+    Scene *scene;
+    Accelerator *accel;
+    std::string accelerator; // Kind of accel: grid, fixed-grid or bvh
+    std::string password;
+    LevelSettings settings;
+    std::vector<SceneSource> sources; // Files the scene was read from
+
+    Level();
+    ~Level();
+
+    bool load(const std::string& path, const LevelOptions& options);
+    bool save(const std::string& path) const;
+
+    static std::string compiledPath(const std::string& path);
+
+private:
+
+    bool loadJSON(const std::string& path, const LevelOptions& options);
+    bool loadCompiled(const std::string& path, const LevelOptions& options);
+    void clear();
+    void createScene(const LevelOptions& options, int num_objects, int num_lights);
+    bool addSource(const std::string& file);
+    void addSprite();
+    void numberObjects();
+    std::vector<Shape*> dynamicObjects() const;
+    void chooseAccelerator(const LevelOptions& options);
+    void buildAccelerator();
+    bool restoreAccelerator(SceneReader& in, const std::string& kind);
+    void applySettings(const LevelOptions& options);
+
+};
+
+#include "level.cpp"
+
+#endif
@@ -1,53 +1,288 @@
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <omp.h>
+#include <glm/common.hpp>
 #include "loader.hpp"
 
-using std::ifstream;
-using std::string;
-using std::stringstream;
+// Start of the line after p, or end
+static inline const char *nextLine(const char *p, const char *end) {
+    const char *newline = static_cast<const char*>(memchr(p, '\n', end - p));
+    return newline == nullptr ? end : newline + 1;
+}
 
-void load(std::vector<Shape *>& objects, std::string filename, float scale, glm::vec3 location, glm::vec3 color, float lambert, float specular, bool refr, float ior) {
-    string line;
-    string type;
-    string v1, v2, v3;
-    int ind1, ind2, ind3;
+static inline const char *skipSpace(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    return p;
+}
 
-    Model *model = new Model();
-    glm::vec3 min = {10000.0, 10000.0, 10000.0};
-    glm::vec3 max = {-10000.0, -10000.0, -10000.0};
+// Start of the next word on the line, or the end of the line's content
+static inline const char *nextWord(const char *p, const char *end) {
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' && *p != '#') {
+        p++;
+    }
+    return skipSpace(p, end);
+}
+
+static inline bool lineDone(const char *p, const char *end) {
+    return p >= end || *p == '\n' || *p == '\r' || *p == '#';
+}
+
+// True if the line at p starts with keyword followed by a space
+static inline bool isKeyword(const char *p, const char *end, const char *keyword) {
+    int length = strlen(keyword);
+    return end - p > length && memcmp(p, keyword, length) == 0 && (p[length] == ' ' || p[length] == '\t');
+}
+
+// The number at p, 0 if there is none. The file is not null terminated, so
+// the word is copied out for strtof.
+static float parseFloat(const char *&p, const char *end) {
+    char word[64];
+    size_t length = 0;
+    while (p + length < end && length < sizeof(word) - 1 && !lineDone(p + length, end) && p[length] != ' ' && p[length] != '\t') {
+        word[length] = p[length];
+        length++;
+    }
+    word[length] = '\0';
+
+    float value = strtof(word, nullptr);
+    p = nextWord(p, end);
+    return value;
+}
+
+// The integer at p, 0 if there is none
+static int parseInt(const char *&p, const char *end) {
+    bool negative = (p < end && *p == '-');
+    if (negative) {
+        p++;
+    }
+
+    int value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = (value * 10) + (*p - '0');
+        p++;
+    }
+
+    return negative ? -value : value;
+}
 
-    ifstream f;
-    f.open(filename);
-    std::vector<glm::vec3> vertices;
-    while (getline(f, line)) {
-        stringstream linestream{line};
-        linestream >> type;
-        if (type == "v") {
+// The vertex and normal indices of a face corner such as 3, 3/1, 3//2 or
+// 3/1/2, 0 where there is none
+static void parseCorner(const char *&p, const char *end, int &vertex, int &normal) {
+    vertex = parseInt(p, end);
+    normal = 0;
+    if (p < end && *p == '/') {
+        p++;
+        parseInt(p, end);
+        if (p < end && *p == '/') {
+            p++;
+            normal = parseInt(p, end);
+        }
+    }
+
+    p = nextWord(p, end);
+}
+
+// An OBJ index as a position in its array: from 1 at the start, or from -1
+// back from the last of count read so far. -1 if there is none.
+static inline int resolveIndex(int index, int count) {
+    if (index > 0) {
+        return index - 1;
+    } else if (index < 0) {
+        return count + index;
+    }
+    return -1;
+}
+
+/* OBJ CHUNK CLASS */
+ObjChunk::ObjChunk(const char *b, const char *e) : begin(b), end(e), vertices(0), normals(0), triangles(0), first_vertex(0), first_normal(0), first_triangle(0),
+                                                   min(10000.0, 10000.0, 10000.0), max(-10000.0, -10000.0, -10000.0) {}
+
+void ObjChunk::count() {
+    for (const char *line = begin; line < end; line = nextLine(line, end)) {
+        const char *p = skipSpace(line, end);
+        if (isKeyword(p, end, "v")) {
+            vertices++;
+        } else if (isKeyword(p, end, "vn")) {
+            normals++;
+        } else if (isKeyword(p, end, "f")) {
+            int corners = 0;
+            for (p = skipSpace(p + 1, end); !lineDone(p, end); p = nextWord(p, end)) {
+                corners++;
+            }
+            triangles += std::max(corners - 2, 0);
+        }
+    }
+}
+
+// Read the chunk's vertices, scaled and moved into place, and split its faces
+// into triangle fans. Corner normals are read only if the model has room for
+// them. Missing indices become -1.
+void ObjChunk::parse(float scale, glm::vec3 location, Model& model) {
+    bool smooth = !model.normals.empty();
+    int vertex = first_vertex;
+    int normal = first_normal;
+    int triangle = first_triangle;
+
+    for (const char *line = begin; line < end; line = nextLine(line, end)) {
+        const char *p = skipSpace(line, end);
+        if (isKeyword(p, end, "v")) {
+            p = skipSpace(p + 1, end);
             glm::vec3 v;
-            linestream >> v.x >> v.y >> v.z;
+            v.x = parseFloat(p, end);
+            v.y = parseFloat(p, end);
+            v.z = parseFloat(p, end);
             v *= scale;
             v += location;
             min = glm::min(v, min);
             max = glm::max(v, max);
-            vertices.push_back(v);
-        } else if (type == "f") {
-            linestream >> v1 >> v2 >> v3;
-            sscanf(v1.c_str(), "%i//", &ind1);
-            sscanf(v2.c_str(), "%i//", &ind2);
-            sscanf(v3.c_str(), "%i//", &ind3);
-            ind1--;
-            ind2--;
-            ind3--;
-            Triangle *tri = new Triangle{vertices[ind1], vertices[ind2], vertices[ind3], color, lambert, specular, refr, ior};
-            model->triangles.push_back(tri);
-            // objects.push_back(tri);
-        } else {
+            model.vertices[vertex++] = v;
+        } else if (isKeyword(p, end, "vn")) {
+            if (smooth) {
+                p = skipSpace(p + 2, end);
+                glm::vec3 n;
+                n.x = parseFloat(p, end);
+                n.y = parseFloat(p, end);
+                n.z = parseFloat(p, end);
+                model.normals[normal] = glm::normalize(n);
+            }
+            normal++;
+        } else if (isKeyword(p, end, "f")) {
+            int corner = 0;
+            glm::ivec3 first, previous;
+            for (p = skipSpace(p + 1, end); !lineDone(p, end); corner++) {
+                int v, n;
+                parseCorner(p, end, v, n);
+                glm::ivec3 current{resolveIndex(v, vertex), resolveIndex(n, normal), 0};
+
+                if (corner == 0) {
+                    first = current;
+                } else if (corner >= 2) {
+                    model.indices[triangle] = glm::ivec3{first.x, previous.x, current.x};
+                    if (smooth) {
+                        model.normal_indices[triangle] = glm::ivec3{first.y, previous.y, current.y};
+                    }
+                    triangle++;
+                }
+                previous = current;
+            }
+        }
+    }
+}
+
+// Read a Wavefront OBJ model into an indexed Model. Texture coordinates are
+// skipped, and normals are kept only for smooth shading. Large files are
+// parsed by several threads at once, each taking a run of lines. A model whose
+// file cannot be read is left out of the scene.
+void load(std::vector<Shape *>& objects, Arena& arena, std::string filename, float scale, glm::vec3 location, glm::vec3 color, const Material *material, bool smooth) {
+    #ifdef DEBUG
+    auto start = std::chrono::high_resolution_clock::now();
+    #endif
+
+    MappedFile file;
+    if (!file.open(filename)) {
+        std::cout << "Failed to read model " << filename << std::endl;
+        return;
+    }
+
+    Model *model = arena.create<Model>(color, material);
+    glm::vec3 min = {10000.0, 10000.0, 10000.0};
+    glm::vec3 max = {-10000.0, -10000.0, -10000.0};
+
+    // Split the file at line ends into about one chunk per thread
+    int num_chunks = std::max(1, std::min(omp_get_max_threads(), (int) (file.size / OBJ_CHUNK_BYTES)));
+    const char *end = file.data + file.size;
+    const char *begin = file.data;
+    std::vector<ObjChunk> chunks;
+    for (int c = 1; c <= num_chunks; c++) {
+        const char *split = (c == num_chunks) ? end : std::max(begin, nextLine(file.data + (file.size / num_chunks) * c, end));
+        chunks.push_back(ObjChunk(begin, split));
+        begin = split;
+    }
+
+    #pragma omp parallel for if (num_chunks > 1)
+    for (int c = 0; c < num_chunks; c++) {
+        chunks[c].count();
+    }
+
+    int num_vertices = 0;
+    int num_normals = 0;
+    int num_triangles = 0;
+    for (auto &chunk : chunks) {
+        chunk.first_vertex = num_vertices;
+        chunk.first_normal = num_normals;
+        chunk.first_triangle = num_triangles;
+        num_vertices += chunk.vertices;
+        num_normals += chunk.normals;
+        num_triangles += chunk.triangles;
+    }
+
+    model->vertices.resize(num_vertices);
+    model->indices.resize(num_triangles);
+    if (smooth && num_normals > 0) {
+        model->normals.resize(num_normals);
+        model->normal_indices.resize(num_triangles);
+    }
+
+    #pragma omp parallel for if (num_chunks > 1)
+    for (int c = 0; c < num_chunks; c++) {
+        chunks[c].parse(scale, location, *model);
+    }
+
+    #ifdef DEBUG
+    auto parsed = std::chrono::high_resolution_clock::now();
+    #endif
+
+    for (auto &chunk : chunks) {
+        min = glm::min(chunk.min, min);
+        max = glm::max(chunk.max, max);
+    }
+
+    // Drop triangles with missing vertices, and normals that are missing
+    int kept = 0;
+    for (int i = 0; i < num_triangles; i++) {
+        const glm::ivec3 &f = model->indices[i];
+        if (std::min({f.x, f.y, f.z}) < 0 || std::max({f.x, f.y, f.z}) >= num_vertices) {
             continue;
         }
+
+        model->indices[kept] = f;
+        if (!model->normal_indices.empty()) {
+            glm::ivec3 n = model->normal_indices[i];
+            if (std::min({n.x, n.y, n.z}) < 0 || std::max({n.x, n.y, n.z}) >= num_normals) {
+                n = glm::ivec3{-1, -1, -1};
+            }
+            model->normal_indices[kept] = n;
+        }
+        kept++;
+    }
+
+    if (kept < num_triangles) {
+        std::cout << "Skipped " << num_triangles - kept << " triangles of " << filename << " with missing vertices" << std::endl;
+        model->indices.resize(kept);
+        if (!model->normal_indices.empty()) {
+            model->normal_indices.resize(kept);
+        }
     }
 
     model->minimum = min;
     model->maximum = max;
+    model->build();
+
+    #ifdef DEBUG
+    double parse_ms = std::chrono::duration_cast<std::chrono::microseconds>(parsed - start).count() / 1000.0;
+    std::cout << "Loaded " << filename << " with " << model->indices.size() << " triangles over " << model->vertices.size() << " vertices"
+              << (model->normals.empty() ? "" : ", smooth shaded") << std::endl;
+    std::cout << "Parsed " << file.size / 1024.0 << " KB in " << parse_ms << " ms on " << num_chunks << " threads ("
+              << (file.size / 1000000.0) / std::max(parse_ms / 1000.0, 1e-6) << " MB/s)" << std::endl;
+    std::cout << "BVH built in " << model->bvh.build_time << " ms: " << model->bvh.nodes.size() << " nodes, "
+              << model->bvh.leaves << " leaves, depth " << model->bvh.depth << ", SAH cost " << model->bvh.cost
+              << " (flat loop " << model->bvh.flatCost(model->indices.size()) << ")" << std::endl;
+    #endif
+
     objects.push_back(model);
-}
\ No newline at end of file
+}
@@ -5,9 +5,37 @@
 #include <string>
 #include <glm/vec3.hpp>
 #include "geometry.hpp"
+#include "mappedfile.hpp"
 
-void load(std::vector<Shape *>& objects, std::string filename, glm::vec3 color, float lambert, float specular, bool refr, float ior);
+// Files at least this large are split into about this many bytes per thread
+const size_t OBJ_CHUNK_BYTES = 1 << 20;
+
+// A run of whole lines of an OBJ file, parsed by one thread. The first pass
+// counts what the chunk holds, so the second can write its vertices and
+// faces straight into place.
+class ObjChunk {
+public:
+
+    const char *begin;
+    const char *end;
+    int vertices;
+    int normals;
+    int triangles; // Faces with n corners count as n - 2 triangles
+    int first_vertex;
+    int first_normal;
+    int first_triangle;
+    glm::vec3 min;
+    glm::vec3 max;
+
+    ObjChunk(const char *b, const char *e);
+
+    void count();
+    void parse(float scale, glm::vec3 location, Model& model);
+
+};
+
+void load(std::vector<Shape *>& objects, Arena& arena, std::string filename, float scale, glm::vec3 location, glm::vec3 color, const Material *material, bool smooth = false);
 
 #include "loader.cpp"
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,55 @@
+#include <fstream>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "mappedfile.hpp"
+
+/* MAPPED FILE CLASS */
+MappedFile::MappedFile() : data(nullptr), size(0) {}
+
+MappedFile::~MappedFile() {
+    #ifndef _WIN32
+    if (data != nullptr && buffer.empty()) {
+        munmap(const_cast<char*>(data), size);
+    }
+    #endif
+}
+
+bool MappedFile::open(const std::string& path) {
+    #ifdef _WIN32
+    std::ifstream f(path, std::ifstream::binary);
+    if (!f) {
+        return false;
+    }
+    buffer.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    data = buffer.data();
+    size = buffer.size();
+    return !buffer.empty();
+    #else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    data = static_cast<const char*>(mapped);
+    size = info.st_size;
+    return true;
+    #endif
+}
@@ -0,0 +1,31 @@
+#ifndef __MAPPEDFILE_HPP__
+#define __MAPPEDFILE_HPP__
+
+#include <string>
+#include <vector>
+
+// A whole file in memory, mapped read only, or read into a buffer where
+// mapping is not available
+class MappedFile {
+public:
+
+    const char *data;
+    size_t size;
+
+    MappedFile();
+    ~MappedFile();
+
+    bool open(const std::string& path);
+
+private:
+
+    std::vector<char> buffer;
+
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+};
+
+#include "mappedfile.cpp"
+
+#endif
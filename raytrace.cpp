@@ -1,6 +1,9 @@
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <chrono>
+#include <algorithm>
+#include <cmath>
 #include <omp.h>
 
 #include <glm/vec3.hpp>
@@ -16,41 +19,43 @@ using std::vector;
 
 /* RAY CLASS */
 // Default Ray constructor
-Ray::Ray() : origin{0.0, 0.0, 0.0}, vector{0.0, 0.0, 0.0}, depth(0), IoR(1.0) {
+Ray::Ray() : origin{0.0, 0.0, 0.0}, vector{0.0, 0.0, 0.0}, depth(0), IoR(1.0), cone(0.0), spread(0.0) {
     invdir = 1.0f/vector;
 };
 
 // Ray constructor taking an origin and direction vector
-Ray::Ray(const glm::vec3 o, const glm::vec3 v) : origin{o}, vector{v}, depth(0), IoR(1.0) {
+Ray::Ray(const glm::vec3 o, const glm::vec3 v) : origin{o}, vector{v}, depth(0), IoR(1.0), cone(0.0), spread(0.0) {
     invdir = 1.0f/vector; 
 };
 
 // Intersect Ray with a scene
 Intersection Ray::intersectObjects(const std::vector<Shape*>& objects) const {
     Intersection collision;
+    intersectObjects(objects, 0, objects.size(), collision);
+    return collision;
+}
 
-    float t = 10000.0;
-    float t_test;
-    
-    for (Shape *o : objects) {
-        if (o->intersect(*this, t_test) && t_test < t && t_test >= 0) {
-            t = t_test;
-            if (o->model) {
-                collision = o->intersected_tri[omp_get_thread_num()];
-            } else {
-                collision.hit = true;
-                collision.obj = o;
-                collision.point = origin + (vector * t);
-                collision.t = t;
-            }
+// Intersect Ray with a range of objects, keeping collision if it is closer
+bool Ray::intersectObjects(const std::vector<Shape*>& objects, int first, int count, Intersection &collision) const {
+    bool found = false;
+    for (int i = first; i < first + count; i++) {
+        if (intersectObject(objects[i], collision)) {
+            found = true;
         }
     }
 
-    return collision;
+    return found;
+}
+
+// Intersect Ray with a single object, keeping collision if it is closer
+bool Ray::intersectObject(Shape *o, Intersection &collision) const {
+    return o->intersectClosest(*this, collision);
 }
 
 // Adapted from https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-box-intersection
 bool Ray::intersectBox(vec3 min, vec3 max, float &t_min, float &t_max) const {
+    COUNT_TRAVERSAL(box_tests, 1);
+
     glm::vec3 sign{(invdir.x < 0), (invdir.y < 0), (invdir.z < 0)};
     glm::vec3 bounds[] = {min, max};
 
@@ -82,6 +87,80 @@ bool Ray::intersectBox(vec3 min, vec3 max, float &t_min, float &t_max) const {
     return true; 
 }
 
+/* RAY PACKET CLASS */
+// Pack the rays in the lanes set in mask into SSE friendly arrays
+RayPacket::RayPacket(const Ray *r, int mask) : active(mask) {
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (mask & (1 << l)) {
+            rays[l] = r[l];
+        }
+        ox[l] = rays[l].origin.x;
+        oy[l] = rays[l].origin.y;
+        oz[l] = rays[l].origin.z;
+        dx[l] = rays[l].vector.x;
+        dy[l] = rays[l].vector.y;
+        dz[l] = rays[l].vector.z;
+        ix[l] = rays[l].invdir.x;
+        iy[l] = rays[l].invdir.y;
+        iz[l] = rays[l].invdir.z;
+        t[l] = 10000.0;
+        hit[l] = nullptr;
+        primitive[l] = -1;
+    }
+}
+
+// Slab test for every ray at once. Returns the mask of rays entering the box
+// before their closest hit, and the nearest entry distance among them.
+int RayPacket::intersectBox(const glm::vec3& min, const glm::vec3& max, float &t_entry) const {
+    COUNT_TRAVERSAL(box_tests, __builtin_popcount(active));
+
+    __m128 t_near = _mm_set1_ps(-INFINITY);
+    __m128 t_far = _mm_set1_ps(INFINITY);
+
+    const float *origin[3] = {ox, oy, oz};
+    const float *inverse[3] = {ix, iy, iz};
+    for (int i = 0; i < 3; i++) {
+        __m128 o = _mm_loadu_ps(origin[i]);
+        __m128 inv = _mm_loadu_ps(inverse[i]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min[i]), o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max[i]), o), inv);
+
+        // A ray lying in a face plane gives 0 * inf = NaN, which bounds nothing
+        __m128 bounded = _mm_cmpord_ps(t0, t1);
+        t_near = _mm_max_ps(t_near, _mm_or_ps(_mm_andnot_ps(bounded, _mm_set1_ps(-INFINITY)), _mm_and_ps(bounded, _mm_min_ps(t0, t1))));
+        t_far = _mm_min_ps(t_far, _mm_or_ps(_mm_andnot_ps(bounded, _mm_set1_ps(INFINITY)), _mm_and_ps(bounded, _mm_max_ps(t0, t1))));
+    }
+
+    t_near = _mm_max_ps(t_near, _mm_setzero_ps());
+    t_far = _mm_min_ps(t_far, _mm_loadu_ps(t));
+
+    int mask = _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) & active;
+
+    float entry[PACKET_SIZE];
+    _mm_storeu_ps(entry, t_near);
+    t_entry = 10000.0;
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (mask & (1 << l)) {
+            t_entry = std::min(t_entry, entry[l]);
+        }
+    }
+
+    return mask;
+}
+
+// Store a primitive's hit distances for the rays in mask
+void RayPacket::record(int mask, __m128 t_hit, Shape *o) {
+    float hit_t[PACKET_SIZE];
+    _mm_storeu_ps(hit_t, t_hit);
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (mask & (1 << l)) {
+            t[l] = hit_t[l];
+            hit[l] = o;
+            primitive[l] = -1;
+        }
+    }
+}
+
 /* CAMERA CLASS */
 // Default constructor for Camera
 Camera::Camera() : WIDTH(640), HEIGHT(480), origin{0.0, 0.0, 0.0}, dir{0.0, 0.0, -1.0} {
@@ -92,6 +171,27 @@ Camera::Camera(int w, int h, float FOV) : WIDTH(w), HEIGHT(h), origin{0.0, 0.0,
     setView(FOV);
 }
 
+// Size the detailed and preview images, leaving the camera on the detailed one
+void Camera::setResolution(int full_width, int full_height, int preview_width, int preview_height) {
+    FULL_WIDTH = full_width;
+    FULL_HEIGHT = full_height;
+    PREVIEW_WIDTH = preview_width;
+    PREVIEW_HEIGHT = preview_height;
+
+    fullHalfWidth = glm::tan((fov / 2) * (M_PI / 180)); // A misnomer, but whatever
+    fullHalfHeight = fullHalfWidth * (full_width/full_height);
+    fullPixelWidth = (fullHalfWidth * 2) / (full_width - 1);
+    fullPixelHeight = (fullHalfHeight * 2) / (full_height - 1);
+
+    previewHalfWidth = glm::tan((fov / 2) * (M_PI / 180)); // A misnomer, but whatever
+    previewHalfHeight = previewHalfWidth * (preview_width/preview_height);
+    previewPixelWidth = (previewHalfWidth * 2) / (preview_width - 1);
+    previewPixelHeight = (previewHalfHeight * 2) / (preview_height - 1);
+
+    setPreview(false);
+    setView(fov);
+}
+
 void Camera::setPreview(bool b) {
     if (b) {
         WIDTH = PREVIEW_WIDTH;
@@ -141,6 +241,30 @@ void Camera::setAngle(const float theta, const float phi) {
     }
 }
 
+// Keep the camera billboard sprite just behind the camera
+void Camera::placeSprite() {
+    if (!using_sprite) {
+        return;
+    }
+
+    glm::vec3 right = rightVector();
+    glm::vec3 up = upVector(right);
+
+    //// Bottom Right
+    sprite_top->v0 = origin + (2.0f*right) + (2.0f*up) - (0.01f * dir);
+    //// Top Left
+    sprite_top->v1 = origin - (2.0f*right) - (2.0f*up) - (0.01f * dir);
+    //// Bottom Left
+    sprite_top->v2 = origin - (2.0f*right) + (2.0f*up) - (0.01f * dir);
+
+    //// Bottom Right
+    sprite_bottom->v0 = origin + (2.0f*right) + (2.0f*up) - (0.01f * dir);
+    //// Top Right
+    sprite_bottom->v1 = origin + (2.0f*right) - (2.0f*up) - (0.01f * dir);
+    //// Top Left
+    sprite_bottom->v2 = origin - (2.0f*right) - (2.0f*up) - (0.01f * dir);
+}
+
 vec3 Camera::rightVector() const {
     return glm::normalize(glm::cross(glm::normalize(dir), vec3{0.0, 1.0, 0.0}));
 }
@@ -149,318 +273,1618 @@ vec3 Camera::upVector(vec3 right) const {
     return glm::normalize(glm::cross(glm::normalize(dir), right));
 }
 
+/* MATERIAL CLASS */
+Material::Material() : lambert(1.0), specular(0.0), refractive(false), IoR(1.0) {}
+Material::Material(float lam, float spec, bool refr, float ior) : lambert(lam), specular(spec), refractive(refr), IoR(ior) {}
+
 /* LIGHT CLASS */
 Light::Light(glm::vec3 p, glm::vec3 c) : position{p}, color{c} {};
 
-bool Light::visible(const glm::vec3& point, const std::vector<Shape*>& objects, Grid &grid, vec3& normal) const {
-    Ray light_ray = Ray{point, glm::normalize(position - point)};
+bool Light::visible(const glm::vec3& point, const std::vector<Shape*>& objects, Accelerator &accel, const vec3& normal) const {
+    vec3 to_light = position - point;
+    float distance = glm::length(to_light);
+    vec3 dir = to_light / distance;
 
     // Return false if light is behind the point
-    if (glm::acos(glm::dot(light_ray.vector, normal)) > M_PI/2.0) {
+    if (glm::dot(dir, normal) < 0) {
         return false;
     }
 
-    Intersection intersect = light_ray.intersectObjects(objects);
-    if (intersect.hit && glm::distance(point, intersect.point) < glm::distance(point, position)) {
-        return false;
+    COUNT_TRAVERSAL(shadow_rays, 1);
+    return !accel.occluded(point, dir, distance);
+}
+
+/* SCENE CLASS */
+Scene::Scene(int w, int h, float fov, int total_objects, int total_lights): camera(Camera{w, h, fov}), objects(std::vector<Shape*>{total_objects}), lights(std::vector<Light*>{total_lights}), adaptive(false), aa_threshold(DEFAULT_AA_THRESHOLD), packets(false), reproject(true), mipmaps(true), tile_size(DEFAULT_TILE_SIZE), threads(0), heatmap(HEATMAP_OFF), tonemap(TONEMAP_FILMIC) {}
+
+// Threads to render and resolve frames on, threads or else the OpenMP default
+int Scene::renderThreads() const {
+    return (threads > 0) ? threads : omp_get_max_threads();
+}
+
+/* PRIMITIVE LIST CLASS */
+// Append objects grouped by type and return where they were placed
+PrimitiveRange PrimitiveList::add(Shape * const *objects, int count) {
+    PrimitiveRange range;
+    range.sphere_first = spheres.size();
+    range.triangle_first = triangles.size();
+    range.other_first = others.size();
+
+    for (int i = 0; i < count; i++) {
+        Shape *o = objects[i];
+        if (Sphere *sphere = dynamic_cast<Sphere*>(o)) {
+            spheres.push_back(SphereData(*sphere));
+        } else if (Triangle *triangle = dynamic_cast<Triangle*>(o)) {
+            triangles.push_back(TriangleData(*triangle));
+        } else {
+            others.push_back(o);
+        }
+    }
+
+    range.sphere_count = spheres.size() - range.sphere_first;
+    range.triangle_count = triangles.size() - range.triangle_first;
+    range.other_count = others.size() - range.other_first;
+
+    return range;
+}
+
+// Ids of the objects in a range, in an order that add() puts back the same way
+void PrimitiveList::ids(const PrimitiveRange& range, std::vector<int>& out) const {
+    for (int i = range.sphere_first; i < range.sphere_first + range.sphere_count; i++) {
+        out.push_back(spheres[i].id);
+    }
+    for (int i = range.triangle_first; i < range.triangle_first + range.triangle_count; i++) {
+        out.push_back(triangles[i].id);
+    }
+    for (int i = range.other_first; i < range.other_first + range.other_count; i++) {
+        out.push_back(others[i]->id);
     }
+}
 
+// False for objects skip(id) leaves out, counting the tests made for the rest
+template <typename SkipFunc>
+static inline bool tested(SkipFunc skip, int id, int rays) {
+    if (skip(id)) {
+        return false;
+    }
+    COUNT_TRAVERSAL(object_tests, rays);
     return true;
 }
 
-/*  * NOTE: The below method theoretically should be faster, as it uses
-    * grid traversal to check for light visibility. With 3 lights in the
-    * room, however, it's actually slower.
-     
-bool Light::visible(const vec3& point, const std::vector<Shape*>& objects, Grid &grid, vec3& normal) const {
-    Ray light_ray = Ray{point, glm::normalize(position - point)};
+// Closest hit in a range, keeping collision if it is closer. skip(id) returns
+// true for objects that need no test, letting the grid apply its mailbox.
+template <typename SkipFunc>
+bool PrimitiveList::intersect(const Ray& ray, const PrimitiveRange& range, Intersection &collision, SkipFunc skip) const {
+    bool found = false;
+    float t_test, u, v;
+
+    for (int i = range.sphere_first; i < range.sphere_first + range.sphere_count; i++) {
+        const SphereData &sphere = spheres[i];
+        if (tested(skip, sphere.id, 1) && sphere.intersect(ray, t_test) && t_test < collision.t && t_test >= 0) {
+            collision.hit = true;
+            collision.obj = sphere.shape;
+            collision.point = ray.origin + (ray.vector * t_test);
+            collision.t = t_test;
+            found = true;
+        }
+    }
 
-    // Return false if light is behind the point
-    if (glm::acos(glm::dot(light_ray.vector, normal)) > M_PI/2.0) {
+    for (int i = range.triangle_first; i < range.triangle_first + range.triangle_count; i++) {
+        const TriangleData &triangle = triangles[i];
+        if (tested(skip, triangle.id, 1) && triangle.intersect(ray, t_test, u, v) && t_test < collision.t && t_test >= 0) {
+            collision.hit = true;
+            collision.obj = triangle.shape;
+            collision.point = ray.origin + (ray.vector * t_test);
+            collision.t = t_test;
+            collision.u = u;
+            collision.v = v;
+            found = true;
+        }
+    }
+
+    for (int i = range.other_first; i < range.other_first + range.other_count; i++) {
+        if (tested(skip, others[i]->id, 1) && ray.intersectObject(others[i], collision)) {
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+// True if anything in a range blocks the ray before t_max
+template <typename SkipFunc>
+bool PrimitiveList::occluded(const Ray& ray, const PrimitiveRange& range, float t_max, SkipFunc skip) const {
+    float t_test, u, v;
+
+    for (int i = range.sphere_first; i < range.sphere_first + range.sphere_count; i++) {
+        if (tested(skip, spheres[i].id, 1) && spheres[i].intersect(ray, t_test) && t_test >= 0 && t_test < t_max) {
+            return true;
+        }
+    }
+
+    for (int i = range.triangle_first; i < range.triangle_first + range.triangle_count; i++) {
+        if (tested(skip, triangles[i].id, 1) && triangles[i].intersect(ray, t_test, u, v) && t_test >= 0 && t_test < t_max) {
+            return true;
+        }
+    }
+
+    for (int i = range.other_first; i < range.other_first + range.other_count; i++) {
+        if (tested(skip, others[i]->id, 1) && others[i]->occludes(ray, t_max)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+template <typename SkipFunc>
+void PrimitiveList::intersectPacket(RayPacket& packet, const PrimitiveRange& range, SkipFunc skip) const {
+    int rays = __builtin_popcount(packet.active);
+
+    for (int i = range.sphere_first; i < range.sphere_first + range.sphere_count; i++) {
+        if (tested(skip, spheres[i].id, rays)) {
+            spheres[i].intersectPacket(packet);
+        }
+    }
+
+    for (int i = range.triangle_first; i < range.triangle_first + range.triangle_count; i++) {
+        if (tested(skip, triangles[i].id, rays)) {
+            triangles[i].intersectPacket(packet);
+        }
+    }
+
+    for (int i = range.other_first; i < range.other_first + range.other_count; i++) {
+        if (tested(skip, others[i]->id, rays)) {
+            others[i]->intersectPacket(packet);
+        }
+    }
+}
+
+// For structures where every object is reached once per ray
+static inline bool neverSkip(int id) {
+    return false;
+}
+
+/* ACCELERATOR CLASS */
+Accelerator::~Accelerator() {}
+
+void Accelerator::reportFrame() {}
+
+/* GRID CLASS */
+Grid::Grid(vec3 s, glm::ivec3 dim, glm::vec3 grid_min, glm::vec3 grid_max) :    size(s),
+                                                                                dimensions(dim),
+                                                                                min(grid_min),
+                                                                                max(grid_max),
+                                                                                cells(dim.x*dim.y*dim.z),
+                                                                                mailbox_size(0),
+                                                                                tests(0),
+                                                                                skipped(0) {}
+
+// Pick a resolution giving cubic cells and about GRID_DENSITY cells per object
+glm::ivec3 Grid::resolution(glm::vec3 s, int primitives) {
+    float extent = std::max({s.x, s.y, s.z});
+    glm::vec3 clamped = glm::max(s, vec3{extent * 0.01f, extent * 0.01f, extent * 0.01f});
+    float cells = GRID_DENSITY * std::max(primitives, 1);
+    float cells_per_unit = glm::pow(cells / (clamped.x * clamped.y * clamped.z), 1.0f/3.0f);
+
+    // A thin axis that would get one cell, like the height of a flat level, is
+    // split in two so the floor and ceiling no longer sit in every cell. The
+    // other axes share the rest of the cells, keeping the total per object.
+    glm::ivec3 dim{0, 0, 0};
+    float free_volume = 1;
+    int free_axes = 0;
+    for (int i = 0; i < 3; i++) {
+        if (primitives > 1 && s[i] >= extent * GRID_SPLIT_EXTENT && glm::round(s[i] * cells_per_unit) < 2) {
+            dim[i] = 2;
+            cells /= 2;
+        } else {
+            free_volume *= clamped[i];
+            free_axes++;
+        }
+    }
+    if (free_axes > 0 && free_axes < 3) {
+        cells_per_unit = glm::pow(cells / free_volume, 1.0f / free_axes);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (dim[i] == 0) {
+            dim[i] = glm::clamp((int) glm::round(s[i] * cells_per_unit), 1, GRID_MAX_RESOLUTION);
+        }
+    }
+
+    return dim;
+}
+
+// Place every object into each cell its bounding box overlaps
+void Grid::fill(const std::vector<Shape*>& objects) {
+    vec3 cell_size = size / (vec3) dimensions;
+    glm::ivec3 cell_min, cell_max;
+
+    for (auto o : objects) {
+        if (std::find(dynamic.begin(), dynamic.end(), o) != dynamic.end()) {
+            continue;
+        }
+
+        cell_min = (glm::ivec3) glm::floor((o->min() - min) / cell_size);
+        cell_max = (glm::ivec3) glm::floor((o->max() - min) / cell_size);
+
+        // Ensure objects on the end are placed in the grid
+        for (int i = 0; i < 3; i++) {
+            cell_min[i] = glm::clamp(cell_min[i], 0, dimensions[i] - 1);
+            cell_max[i] = glm::clamp(cell_max[i], 0, dimensions[i] - 1);
+        }
+
+        for (int z = cell_min.z; z <= cell_max.z; z++) {
+            for (int y = cell_min.y; y <= cell_max.y; y++) {
+                for (int x = cell_min.x; x <= cell_max.x; x++) {
+                    at(x, y, z).push_back(o);
+                }
+            }
+        }
+    }
+
+    pack();
+}
+
+// Copy every cell's objects into contiguous per type runs for traversal, and
+// size the mailboxes for the highest object id
+void Grid::pack() {
+    cell_ranges.resize(cells.size());
+    for (int c = 0; c < (int) cells.size(); c++) {
+        cell_ranges[c] = primitives.add(cells[c].data(), cells[c].size());
+        for (Shape *o : cells[c]) {
+            mailbox_size = std::max(mailbox_size, o->id + 1);
+        }
+    }
+}
+
+void Grid::printStats() const {
+    int empty = 0;
+    int most = 0;
+    long references = 0;
+    for (auto &cell : cells) {
+        if (cell.empty()) {
+            empty++;
+        }
+        most = std::max(most, (int) cell.size());
+        references += cell.size();
+    }
+
+    int occupied = cells.size() - empty;
+    printf("Created %ix%ix%i uniform grid from (%.2f, %.2f, %.2f) to (%.2f, %.2f, %.2f)\n", dimensions.x, dimensions.y, dimensions.z, min.x, min.y, min.z, max.x, max.y, max.z);
+    printf("%i cells, %i empty (%.1f%%), %li object references\n", (int) cells.size(), empty, 100.0 * empty / cells.size(), references);
+    printf("Objects per occupied cell: %.2f average, %i max\n", occupied > 0 ? (double) references / occupied : 0.0, most);
+}
+
+vector<Shape *>& Grid::at(int x, int y, int z) {
+    return cells[(dimensions.x * dimensions.y * z) + (dimensions.x * y) + x];
+}
+
+/* GRID CURSOR CLASS */
+// Axis of the nearest cell boundary
+int GridCursor::nextAxis() const {
+    uint8_t k = ((next_crossing_t.x < next_crossing_t.y) << 2) + 
+                ((next_crossing_t.x < next_crossing_t.z) << 1) + 
+                ((next_crossing_t.y < next_crossing_t.z));
+    static const uint8_t map[8] = {2, 1, 2, 1, 2, 2, 0, 0};
+    return map[k];
+}
+
+// Step into the next cell along axis, false once the ray leaves the grid
+bool GridCursor::advance(int axis) {
+    cell[axis] += step[axis];
+
+    if (cell[axis] == exit[axis])
         return false;
+
+    next_crossing_t[axis] += delta_t[axis];
+    return true;
+}
+
+// Per thread mailboxes: the id of the last ray each object was tested against
+static thread_local std::vector<unsigned int> mailbox;
+static thread_local unsigned int mailbox_ray = 0;
+
+// Object tests made and skipped on this thread since the last walk finished
+#ifdef DEBUG
+static thread_local long mailbox_tests = 0;
+static thread_local long mailbox_skipped = 0;
+#endif
+
+// Start a new mailbox ray on this thread, clearing the mailbox when the id wraps
+static void newMailboxRay(int size) {
+    if (mailbox.size() < (size_t) size) {
+        mailbox.assign(size, 0);
+    }
+    if (++mailbox_ray == 0) {
+        std::fill(mailbox.begin(), mailbox.end(), 0);
+        mailbox_ray = 1;
     }
+}
 
+// True for objects already tested against the current ray, marking the rest
+static inline bool mailboxed(int id) {
+    if (mailbox[id] == mailbox_ray) {
+        #ifdef DEBUG
+        mailbox_skipped++;
+        #endif
+        return true;
+    }
+    mailbox[id] = mailbox_ray;
+    #ifdef DEBUG
+    mailbox_tests++;
+    #endif
+    return false;
+}
+
+// Set up traversal for a ray, starting at the origin if it is inside the grid
+bool Grid::enter(const Ray& ray, GridCursor &cursor) const {
     float t_min, t_max;
-    if (!light_ray.intersectBox(grid.min, grid.max, t_min, t_max)) {
+    if (!ray.intersectBox(min, max, t_min, t_max) || t_max < 0) {
         return false;
     }
+    t_min = std::max(t_min, 0.0f);
 
-    // Setup traversal
-    vec3 cell_dimensions = (grid.size) / (vec3) grid.dimensions;
+    vec3 cell_dimensions = size / (vec3) dimensions;
 
-    glm::vec3 ray_orig_cell, delta_t, next_crossing_t;
-    glm::ivec3 step, exit, current_cell;
+    glm::vec3 ray_orig_cell;
     for (int i = 0; i < 3; i++) {
-        ray_orig_cell[i] = (light_ray.origin[i] + (light_ray.vector[i] * t_min)) - grid.min[i];
-        current_cell[i] = glm::clamp((int) glm::floor(ray_orig_cell[i] / cell_dimensions[i]), 0, grid.dimensions[i] - 1);
-        if (light_ray.vector[i] < 0) {
-            delta_t[i] = -cell_dimensions[i] * light_ray.invdir[i];
-            next_crossing_t[i] = t_min + (current_cell[i] * cell_dimensions[i] - ray_orig_cell[i]) * light_ray.invdir[i];
-            exit[i] = -1;
-            step[i] = -1;
+        ray_orig_cell[i] = (ray.origin[i] + (ray.vector[i] * t_min)) - min[i];
+        cursor.cell[i] = glm::clamp((int) glm::floor(ray_orig_cell[i] / cell_dimensions[i]), 0, dimensions[i] - 1);
+        if (ray.vector[i] < 0) {
+            cursor.delta_t[i] = -cell_dimensions[i] * ray.invdir[i];
+            cursor.next_crossing_t[i] = t_min + (cursor.cell[i] * cell_dimensions[i] - ray_orig_cell[i]) * ray.invdir[i];
+            cursor.exit[i] = -1;
+            cursor.step[i] = -1;
         } else {
-            delta_t[i] = cell_dimensions[i] * light_ray.invdir[i];
-            next_crossing_t[i] = t_min + ((current_cell[i] + 1) * cell_dimensions[i] - ray_orig_cell[i]) * light_ray.invdir[i];
-            exit[i] = grid.dimensions[i];
-            step[i] = 1;
+            cursor.delta_t[i] = cell_dimensions[i] * ray.invdir[i];
+            cursor.next_crossing_t[i] = t_min + ((cursor.cell[i] + 1) * cell_dimensions[i] - ray_orig_cell[i]) * ray.invdir[i];
+            cursor.exit[i] = dimensions[i];
+            cursor.step[i] = 1;
         }
     }
 
+    return true;
+}
+
+// Walk the cells along a ray in order. visit(range) tests a cell's objects and
+// returns true to end the walk, stop(t_exit) is called after each cell and
+// returns true when later cells cannot matter. Objects spanning several cells
+// are tested once per ray by passing mailboxed as the skip test.
+template <typename CellFunc, typename StopFunc>
+void Grid::walk(const Ray& ray, CellFunc visit, StopFunc stop) {
+    GridCursor cursor;
+    if (!enter(ray, cursor)) {
+        return;
+    }
+
+    newMailboxRay(mailbox_size);
+
     // Traverse grid
-    Intersection collision;
     while (true) {
-        collision = light_ray.intersectObjects(grid.at(current_cell.x, current_cell.y, current_cell.z));
+        COUNT_TRAVERSAL(cells, 1);
+        if (visit(cell_ranges[(dimensions.x * dimensions.y * cursor.cell.z) + (dimensions.x * cursor.cell.y) + cursor.cell.x]))
+            break;
 
-        Uint8 k =   ((next_crossing_t.x < next_crossing_t.y) << 2) + 
-                    ((next_crossing_t.x < next_crossing_t.z) << 1) + 
-                    ((next_crossing_t.y < next_crossing_t.z));
-        static const Uint8 map[8] = {2, 1, 2, 1, 2, 2, 0, 0};
-        Uint8 axis = map[k];
+        int axis = cursor.nextAxis();
 
-        if (collision.t < next_crossing_t[axis])
+        if (stop(cursor.next_crossing_t[axis]))
             break;
 
-        current_cell[axis] += step[axis];
-
-        if (current_cell[axis] == exit[axis])
+        if (!cursor.advance(axis))
             break;
+    }
 
-        next_crossing_t[axis] += delta_t[axis];
+    #ifdef DEBUG
+    tests += mailbox_tests;
+    skipped += mailbox_skipped;
+    mailbox_tests = mailbox_skipped = 0;
+    #endif
+}
 
-        if (collision.hit && glm::distance(point, collision.point) < glm::distance(point, position)) {
-            return false;
+Intersection Grid::intersect(const Ray& ray) {
+    Intersection collision;
+    ray.intersectObjects(dynamic, 0, dynamic.size(), collision);
+
+    // Keep the closest hit across cells, finishing once it lies inside the current cell
+    walk(ray, [&](const PrimitiveRange& cell) {
+        primitives.intersect(ray, cell, collision, mailboxed);
+        return false;
+    }, [&](float t_exit) {
+        return collision.t < t_exit;
+    });
+
+    return collision;
+}
+
+// Walk the rays of a packet through the grid in step, one cell each at a time.
+// Objects met by any ray are tested against the whole packet once.
+void Grid::intersectPacket(RayPacket& packet) {
+    for (Shape *o : dynamic) {
+        o->intersectPacket(packet);
+    }
+
+    GridCursor cursors[PACKET_SIZE];
+    int walking = 0;
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if ((packet.active & (1 << l)) && enter(packet.rays[l], cursors[l])) {
+            walking |= (1 << l);
         }
     }
+    if (!walking) {
+        return;
+    }
 
-    return true;
+    newMailboxRay(mailbox_size);
+
+    while (walking) {
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            if (walking & (1 << l)) {
+                COUNT_TRAVERSAL(cells, 1);
+                glm::ivec3 &cell = cursors[l].cell;
+                primitives.intersectPacket(packet, cell_ranges[(dimensions.x * dimensions.y * cell.z) + (dimensions.x * cell.y) + cell.x], mailboxed);
+            }
+        }
+
+        // A ray is finished once its closest hit lies inside its current cell
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            if (!(walking & (1 << l))) {
+                continue;
+            }
+            int axis = cursors[l].nextAxis();
+            if (packet.t[l] < cursors[l].next_crossing_t[axis] || !cursors[l].advance(axis)) {
+                walking &= ~(1 << l);
+            }
+        }
+    }
 
+    #ifdef DEBUG
+    tests += mailbox_tests;
+    skipped += mailbox_skipped;
+    mailbox_tests = mailbox_skipped = 0;
+    #endif
 }
-*/
 
-/* SCENE CLASS */
-Scene::Scene(int w, int h, float fov, int total_objects, int total_lights): camera(Camera{w, h, fov}), objects(std::vector<Shape*>{total_objects}), lights(std::vector<Light*>{total_lights}) {}
+bool Grid::occluded(const glm::vec3& origin, const glm::vec3& dir, float t_max) {
+    Ray ray{origin, dir};
+    for (Shape *o : dynamic) {
+        if (o->occludes(ray, t_max)) {
+            return true;
+        }
+    }
 
-/* GRID CLASS */
-Grid::Grid(vec3 s, glm::ivec3 dim, glm::vec3 grid_min, glm::vec3 grid_max) :    size(s),
-                                                                                dimensions(dim),
-                                                                                min(grid_min),
-                                                                                max(grid_max),
-                                                                                cells(dim.x*dim.y*dim.z) {}
+    // Finish at the first blocker, or once the walk passes the end of the segment
+    bool blocked = false;
+    walk(ray, [&](const PrimitiveRange& cell) {
+        blocked = primitives.occluded(ray, cell, t_max, mailboxed);
+        return blocked;
+    }, [&](float t_exit) {
+        return t_exit > t_max;
+    });
 
-vector<Shape *>& Grid::at(int x, int y, int z) {
-    return cells[(dimensions.x * dimensions.y * z) + (dimensions.x * y) + x];
+    return blocked;
+}
+
+void Grid::reportFrame() {
+    long made = tests.exchange(0);
+    long saved = skipped.exchange(0);
+    printf("Grid object tests: %li, redundant tests skipped by mailboxing: %li (%.1f%%)\n", made, saved, (made + saved) > 0 ? 100.0 * saved / (made + saved) : 0.0);
+}
+
+/* SCENE BVH CLASS */
+SceneBVH::SceneBVH() {}
+
+void SceneBVH::build(const std::vector<Shape*>& scene_objects) {
+    objects.clear();
+    for (auto o : scene_objects) {
+        if (std::find(dynamic.begin(), dynamic.end(), o) == dynamic.end()) {
+            objects.push_back(o);
+        }
+    }
+
+    std::vector<glm::vec3> mins(objects.size());
+    std::vector<glm::vec3> maxs(objects.size());
+    for (int i = 0; i < (int) objects.size(); i++) {
+        mins[i] = objects[i]->min();
+        maxs[i] = objects[i]->max();
+    }
+
+    bvh.build(mins, maxs);
+
+    // Reorder objects so every leaf is a contiguous range
+    std::vector<Shape *> ordered(objects.size());
+    for (int i = 0; i < (int) objects.size(); i++) {
+        ordered[i] = objects[bvh.order[i]];
+    }
+    objects.swap(ordered);
+
+    // Copy each leaf's objects into per type runs. Leaf nodes index leaf_ranges afterwards.
+    leaf_ranges.clear();
+    for (auto &node : bvh.nodes) {
+        if (node.count > 0) {
+            leaf_ranges.push_back(primitives.add(&objects[node.first], node.count));
+            node.first = leaf_ranges.size() - 1;
+            node.count = 1;
+        }
+    }
+}
+
+Intersection SceneBVH::intersect(const Ray& ray) {
+    Intersection collision;
+    ray.intersectObjects(dynamic, 0, dynamic.size(), collision);
+
+    float t_closest = collision.t;
+    bvh.traverse(ray.origin, ray.invdir, t_closest, [&](int first, int count) {
+        if (primitives.intersect(ray, leaf_ranges[first], collision, neverSkip)) {
+            t_closest = collision.t;
+        }
+        return false;
+    });
+
+    return collision;
+}
+
+void SceneBVH::intersectPacket(RayPacket& packet) {
+    for (Shape *o : dynamic) {
+        o->intersectPacket(packet);
+    }
+
+    bvh.traversePacket(packet, [&](int first, int count) {
+        primitives.intersectPacket(packet, leaf_ranges[first], neverSkip);
+    });
+}
+
+bool SceneBVH::occluded(const glm::vec3& origin, const glm::vec3& dir, float t_max) {
+    Ray ray{origin, dir};
+    for (Shape *o : dynamic) {
+        if (o->occludes(ray, t_max)) {
+            return true;
+        }
+    }
+
+    // Any blocker ends the traversal, nodes beyond the light are never visited
+    bool blocked = false;
+    bvh.traverse(ray.origin, ray.invdir, t_max, [&](int first, int count) {
+        blocked = primitives.occluded(ray, leaf_ranges[first], t_max, neverSkip);
+        return blocked;
+    });
+
+    return blocked;
 }
 
-Uint32 vecToHex(glm::vec3 v) { // maybe inline this?
-    return (((Uint32) (v.r * 255.0)) << 16) + (((Uint32) (v.g * 255.0)) << 8) + ((Uint32) (v.b * 255.0));
+uint32_t vecToHex(glm::vec3 v) { // maybe inline this?
+    return (((uint32_t) (v.r * 255.0)) << 16) + (((uint32_t) (v.g * 255.0)) << 8) + ((uint32_t) (v.b * 255.0));
 }
 
-void hexToVec(glm::vec3 &v, const Uint32 &h) {
+void hexToVec(glm::vec3 &v, const uint32_t &h) {
     v.r = ((h >> 16) & 255) / 255.0;
     v.g = ((h >> 8) & 255) / 255.0;
     v.b = (h & 255) / 255.0;
 }
 
-void render(Uint32 *buffer, Scene &scene, Grid& grid) {
+/* TILE SCHEDULER CLASS */
+// Interleave the bits of x and y so that nearby tiles get nearby codes
+static unsigned int mortonCode(unsigned int x, unsigned int y) {
+    unsigned int code = 0;
+    for (int bit = 0; bit < 16; bit++) {
+        code |= ((x >> bit) & 1) << (2 * bit);
+        code |= ((y >> bit) & 1) << (2 * bit + 1);
+    }
+    return code;
+}
+
+static inline uint64_t packRange(uint32_t first, uint32_t last) {
+    return ((uint64_t) first << 32) | last;
+}
+
+TileScheduler::TileScheduler() : steals(0), range_count(0) {}
+
+TileScheduler::TileScheduler(TileScheduler&& other) : steals(0), range_count(0) {
+    *this = std::move(other);
+}
+
+// Atomics cannot move, so the lists are swapped and the counters copied
+TileScheduler& TileScheduler::operator=(TileScheduler&& other) {
+    tiles.swap(other.tiles);
+    ranges.swap(other.ranges);
+    order.swap(other.order);
+    steals = other.steals.load();
+    range_count = other.range_count;
+    return *this;
+}
+
+// Lay out the tiles of a pass and split them between the threads. Nothing is
+// allocated unless the image has more tiles or there are more threads than
+// before.
+void TileScheduler::reset(int width, int height, int tile_size, int threads) {
+    int columns = (width + tile_size - 1) / tile_size;
+    int rows = (height + tile_size - 1) / tile_size;
+
+    order.clear();
+    for (int ty = 0; ty < rows; ty++) {
+        for (int tx = 0; tx < columns; tx++) {
+            order.push_back(std::make_pair(mortonCode(tx, ty), (int) order.size()));
+        }
+    }
+    std::sort(order.begin(), order.end());
+
+    tiles.clear();
+    for (auto &o : order) {
+        Tile tile;
+        tile.x = (o.second % columns) * tile_size;
+        tile.y = (o.second / columns) * tile_size;
+        tile.width = std::min(tile_size, width - tile.x);
+        tile.height = std::min(tile_size, height - tile.y);
+        tile.thread = -1;
+        tile.seconds = 0.0;
+        tiles.push_back(tile);
+    }
+
+    // Ranges hold atomics, which cannot be moved into a larger vector
+    range_count = std::max(threads, 1);
+    if ((int) ranges.size() < range_count) {
+        std::vector<Range>(range_count).swap(ranges);
+    }
+    for (int i = 0; i < range_count; i++) {
+        ranges[i].bounds = packRange((uint32_t) ((long) tiles.size() * i / range_count), (uint32_t) ((long) tiles.size() * (i + 1) / range_count));
+    }
+    steals = 0;
+}
+
+// Next tile for a thread to render, false once every tile has been taken
+bool TileScheduler::next(int thread, int &tile) {
+    int count = range_count;
+    if (takeFront(thread % count, tile)) {
+        return true;
+    }
+
+    for (int i = 1; i < count; i++) {
+        if (takeBack((thread + i) % count, tile)) {
+            steals++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool TileScheduler::takeFront(int range, int &tile) {
+    uint64_t bounds = ranges[range].bounds.load();
+    while (true) {
+        uint32_t first = bounds >> 32;
+        uint32_t last = bounds & 0xFFFFFFFF;
+        if (first >= last) {
+            return false;
+        }
+        if (ranges[range].bounds.compare_exchange_weak(bounds, packRange(first + 1, last))) {
+            tile = first;
+            return true;
+        }
+    }
+}
+
+bool TileScheduler::takeBack(int range, int &tile) {
+    uint64_t bounds = ranges[range].bounds.load();
+    while (true) {
+        uint32_t first = bounds >> 32;
+        uint32_t last = bounds & 0xFFFFFFFF;
+        if (first >= last) {
+            return false;
+        }
+        if (ranges[range].bounds.compare_exchange_weak(bounds, packRange(first, last - 1))) {
+            tile = last - 1;
+            return true;
+        }
+    }
+}
+
+/* PROGRESSIVE FRAME CLASS */
+// Added to luminance sums so contrast between near black pixels stays small
+const float CONTRAST_EPSILON = 0.01;
+
+static inline float luminance(const vec3& c) {
+    return (0.3 * c.r) + (0.5 * c.g) + (0.2 * c.b);
+}
+
+ProgressiveFrame::ProgressiveFrame() : width(0), height(0), AA(1), adaptive(false), threshold(DEFAULT_AA_THRESHOLD), passes(0), total_passes(0), heatmap(HEATMAP_OFF) {}
+
+void ProgressiveFrame::reset(int w, int h, int aa, bool adapt, float thresh, HeatmapMode heat) {
+    width = w;
+    height = h;
+    AA = aa;
+    adaptive = adapt && aa > 1;
+    threshold = thresh;
+    passes = 0;
+    total_passes = adaptive ? 2 : aa * aa;
+    samples.assign(w * h, vec3{0.0, 0.0, 0.0});
+    counts.assign(w * h, 0);
+    ids.assign(w * h, -1);
+    heatmap = heat;
+    cost.assign((heat != HEATMAP_OFF) ? w * h : 0, 0.0);
+
+    // Corners first, so a pixel whose corners agree with its center can stop
+    // there. For odd AA the middle of the grid is the center itself.
+    refine_order.clear();
+    if (adaptive) {
+        int corners[4] = {0, aa - 1, (aa - 1) * aa, (aa * aa) - 1};
+        for (int c : corners) {
+            refine_order.push_back(c);
+        }
+        for (int sample = 0; sample < aa * aa; sample++) {
+            bool corner = std::find(corners, corners + 4, sample) != corners + 4;
+            bool center = (aa % 2 == 1) && sample == ((aa / 2) * aa) + (aa / 2);
+            if (!corner && !center) {
+                refine_order.push_back(sample);
+            }
+        }
+    }
+}
+
+bool ProgressiveFrame::done() const {
+    return passes >= total_passes;
+}
+
+// True if the object or luminance seen through a pixel's center differs from
+// one of its neighbours'
+bool ProgressiveFrame::needsSamples(int x, int y) const {
+    const int offsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+
+    int i = (y * width) + x;
+    float l = luminance(samples[i]);
+    for (auto &o : offsets) {
+        int nx = x + o[0];
+        int ny = y + o[1];
+        if (nx < 0 || ny < 0 || nx >= width || ny >= height) {
+            continue;
+        }
+
+        int j = (ny * width) + nx;
+        float ln = luminance(samples[j]);
+        if (ids[j] != ids[i] || glm::abs(l - ln) > threshold * (l + ln + CONTRAST_EPSILON)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static long totalSamples(const ProgressiveFrame& frame) {
+    long total = 0;
+    for (int c : frame.counts) {
+        total += c;
+    }
+    return total;
+}
+
+double ProgressiveFrame::samplesPerPixel() const {
+    return counts.empty() ? 0.0 : (double) totalSamples(*this) / counts.size();
+}
+
+/* FRAME HISTORY CLASS */
+// Least cosine between a surface and the ray used to widen the match distance,
+// so surfaces seen at a glancing angle are not matched across several pixels
+const float REPROJECT_MIN_COSINE = 0.25;
+
+FrameHistory::FrameHistory() : valid(false) {}
+
+// Index of the history pixel that shaded the point a ray hits, found by
+// projecting the point into the old view and picking the nearest matching
+// point among the four pixels around it. -1 if none is close enough.
+int FrameHistory::find(const Ray& ray, const Intersection& collision, const vec3& normal) const {
+    vec3 v = collision.point - camera.origin;
+    float depth = glm::dot(v, forward);
+    if (depth <= 0.0) {
+        return -1;
+    }
+
+    // Invert cameraRay to get the point's position in the old image
+    float fx = (((glm::dot(v, right) / depth / camera.aspectRatio) + camera.halfWidth) / camera.pixelWidth) - 0.5f;
+    float fy = (((glm::dot(v, up) / depth) + camera.halfHeight) / camera.pixelHeight) - 0.5f;
+    if (!(fx > -1.0f && fy > -1.0f && fx < camera.WIDTH && fy < camera.HEIGHT)) {
+        return -1;
+    }
+    int x0 = (int) glm::floor(fx);
+    int y0 = (int) glm::floor(fy);
+
+    // Half a pixel's width at the point
+    float cosine = std::max(glm::abs(glm::dot(normal, ray.vector)), REPROJECT_MIN_COSINE);
+    float closest = 0.5f * collision.t * camera.pixelWidth * camera.aspectRatio / cosine;
+
+    int found = -1;
+    for (int y = y0; y <= y0 + 1; y++) {
+        for (int x = x0; x <= x0 + 1; x++) {
+            if (x < 0 || y < 0 || x >= camera.WIDTH || y >= camera.HEIGHT) {
+                continue;
+            }
+
+            int i = (y * camera.WIDTH) + x;
+            if (ids[i] != collision.obj->id || glm::dot(normals[i], normal) <= 0.0) {
+                continue;
+            }
+
+            float distance = glm::length(points[i] - collision.point);
+            if (distance < closest) {
+                closest = distance;
+                found = i;
+            }
+        }
+    }
+
+    return found;
+}
+
+// True if an object that moves with the camera blocks the way from a point to
+// any of the lights
+static bool dynamicShadow(const vec3& point, const vec3& normal, const vector<Light*>& lights, const Accelerator& accel) {
+    vec3 origin = point + (normal * 0.01f);
+    for (auto &l : lights) {
+        vec3 to_light = l->position - origin;
+        float distance = glm::length(to_light);
+        Ray ray{origin, to_light / distance};
+        for (Shape *o : accel.dynamic) {
+            if (o->occludes(ray, distance)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* RENDERING */
+// Sample index of a pixel's center, the others index the AA grid
+const int CENTER_SAMPLE = -1;
+
+// Position of a sample within its pixel
+static inline void sampleOffset(int sample, int AA, float &ox, float &oy) {
+    if (sample == CENTER_SAMPLE) {
+        ox = oy = 0.5;
+        return;
+    }
+    ox = (float) (sample / AA + 1) / (float) (AA + 1);
+    oy = (float) (sample % AA + 1) / (float) (AA + 1);
+}
+
+// Viewing ray through the point (x + ox, y + oy) of the image
+static inline void cameraRay(Ray &ray, int x, int y, float ox, float oy, const Scene &scene, const vec3& cameraForward, const vec3& cameraRight, const vec3& cameraUp) {
+    ray.origin = scene.camera.origin;
+
+    vec3 px = cameraRight * (( (x + ox) * scene.camera.pixelWidth) - scene.camera.halfWidth) * scene.camera.aspectRatio;
+    vec3 py = cameraUp * (( (y + oy) * scene.camera.pixelHeight) - scene.camera.halfHeight);
+
+    ray.vector = glm::normalize(cameraForward + px + py);
+    ray.invdir = 1.0f/ray.vector;
+
+    // The ray's footprint grows by about a pixel for each unit of distance
+    ray.cone = 0.0;
+    ray.spread = scene.mipmaps ? scene.camera.pixelHeight : 0.0f;
+}
+
+// This thread's running total of what a heatmap shows, so the cost of a
+// sample is the difference of the readings before and after tracing it
+static inline double costReading(HeatmapMode heatmap) {
+    const TraversalStats &counts = threadTraversalStats();
+    switch (heatmap) {
+        case HEATMAP_CELLS:
+            return counts.cells;
+        case HEATMAP_TESTS:
+            return counts.object_tests + counts.triangle_tests;
+        case HEATMAP_SHADOW_RAYS:
+            return counts.shadow_rays;
+        case HEATMAP_TIME:
+            return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        default:
+            return 0.0;
+    }
+}
+
+// Closest hit of each active ray, found for the rays together or one at a time
+static void closestHits(const Ray *rays, int active, bool packets, Accelerator& accel, Intersection *collisions) {
+    if (!packets) {
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            if (active & (1 << l)) {
+                collisions[l] = accel.intersect(rays[l]);
+            }
+        }
+        return;
+    }
+
+    RayPacket packet{rays, active};
+    accel.intersectPacket(packet);
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (!(active & (1 << l)) || packet.hit[l] == nullptr) {
+            continue;
+        }
+
+        // Repeat the winning test for this ray alone, which fills in the
+        // rest of the hit record such as barycentric coordinates
+        if (!packet.hit[l]->intersectPrimitive(rays[l], packet.primitive[l], collisions[l])) {
+            collisions[l] = accel.intersect(rays[l]);
+        }
+    }
+}
+
+// Trace samples [first, first + count) of a 2x2 block of pixels, whose viewing
+// rays are traced together as a packet, and add them to the frame. Heatmaps
+// trace the rays one at a time so each pixel's cost is its own.
+static void renderBlock(int bx, int by, int first, int count, ProgressiveFrame& frame, Scene &scene, Accelerator& accel, const vec3& cameraForward, const vec3& cameraRight, const vec3& cameraUp) {
+    Ray rays[PACKET_SIZE];
+    int ids[PACKET_SIZE];
+    float costs[PACKET_SIZE];
+    float ox, oy;
+
+    // Start with black pixels
+    vec3 colors[PACKET_SIZE];
+    int active = 0;
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        colors[l] = vec3{0.0, 0.0, 0.0};
+        ids[l] = -1;
+        costs[l] = 0.0;
+        if (bx + (l & 1) < frame.width && by + (l >> 1) < frame.height) {
+            active |= (1 << l);
+        }
+    }
+
+    for (int sample = first; sample < first + count; sample++) {
+        sampleOffset(sample, frame.AA, ox, oy);
+
+        // Create rays
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            cameraRay(rays[l], bx + (l & 1), by + (l >> 1), ox, oy, scene, cameraForward, cameraRight, cameraUp);
+        }
+
+        // Check for collisions with the scene
+        if (scene.packets && frame.heatmap == HEATMAP_OFF) {
+            tracePacket(rays, active, scene.objects, scene.lights, accel, colors, ids);
+        } else {
+            for (int l = 0; l < PACKET_SIZE; l++) {
+                if (active & (1 << l)) {
+                    double before = costReading(frame.heatmap);
+                    Intersection collision = accel.intersect(rays[l]);
+                    colors[l] += shade(rays[l], collision, scene.objects, scene.lights, accel);
+                    ids[l] = collision.hit ? collision.obj->id : -1;
+                    costs[l] += costReading(frame.heatmap) - before;
+                }
+            }
+        }
+    }
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (active & (1 << l)) {
+            int i = (by + (l >> 1)) * frame.width + bx + (l & 1);
+            frame.samples[i] += colors[l];
+            frame.counts[i] += count;
+            if (first == CENTER_SAMPLE) {
+                frame.ids[i] = ids[l];
+            }
+            if (frame.heatmap != HEATMAP_OFF) {
+                frame.cost[i] += costs[l];
+            }
+        }
+    }
+}
+
+// Add AA grid samples to a pixel of an adaptive frame, stopping after the
+// corners when their luminance deviates little from the mean
+static void refinePixel(int x, int y, ProgressiveFrame& frame, Scene &scene, Accelerator& accel, const vec3& cameraForward, const vec3& cameraRight, const vec3& cameraUp) {
+    int i = (y * frame.width) + x;
+    vec3 sum = frame.samples[i];
+    int n = frame.counts[i];
+    double l = luminance(sum / (float) n);
+    double l_sum = l * n;
+    double l_squares = l * l * n;
+
+    Ray ray;
+    float ox, oy;
+    int corners = std::min(4, (int) frame.refine_order.size());
+    for (int k = 0; k < (int) frame.refine_order.size(); k++) {
+        if (k == corners) {
+            double mean = l_sum / n;
+            double deviation = glm::sqrt(std::max(0.0, (l_squares / n) - (mean * mean)));
+            if (deviation <= frame.threshold * (mean + CONTRAST_EPSILON)) {
+                break;
+            }
+        }
+
+        sampleOffset(frame.refine_order[k], frame.AA, ox, oy);
+        cameraRay(ray, x, y, ox, oy, scene, cameraForward, cameraRight, cameraUp);
+        double before = costReading(frame.heatmap);
+        vec3 color = shade(ray, accel.intersect(ray), scene.objects, scene.lights, accel);
+        if (frame.heatmap != HEATMAP_OFF) {
+            frame.cost[i] += costReading(frame.heatmap) - before;
+        }
+
+        sum += color;
+        l = luminance(color);
+        l_sum += l;
+        l_squares += l * l;
+        n++;
+    }
+
+    frame.samples[i] = sum;
+    frame.counts[i] = n;
+}
+
+// Render every sample of a frame at once, into a frame kept by the caller
+RenderStats render(uint32_t *buffer, Scene &scene, Accelerator& accel, ProgressiveFrame& frame) {
+    frame.reset(scene.camera.WIDTH, scene.camera.HEIGHT, scene.AA, scene.adaptive, scene.aa_threshold, scene.heatmap);
+
+    RenderStats stats = renderPasses(frame, scene, accel, frame.total_passes, nullptr);
+
+    // convert vec3 vector to a uint32_t array with tone mapping
+    resolveFrame(buffer, frame, scene);
+
+    return stats;
+}
+
+// Render a preview into current, shading only the pixels the history cannot
+// supply, and swap the two so history holds the new preview
+RenderStats renderReprojected(uint32_t *buffer, Scene &scene, Accelerator& accel, FrameHistory& history, FrameHistory& current) {
+    int width = scene.camera.WIDTH;
+    int height = scene.camera.HEIGHT;
+    bool reuse = scene.reproject && history.valid && history.camera.WIDTH == width && history.camera.HEIGHT == height;
+
     #ifdef DEBUG
-    std::cout << "Rendering" << (scene.camera.preview ? " preview" : "") << std::endl;
-    std::cout << "Camera has width " << scene.camera.WIDTH << " and height " << scene.camera.HEIGHT << std::endl;
+    std::cout << "Rendering" << (scene.camera.preview ? " preview" : "") << (reuse ? " from the last frame" : "") << std::endl;
     #endif
 
-    // Create vector of rgb pixels
-    std::vector<vec3> pixels(scene.camera.WIDTH*scene.camera.HEIGHT);
-
     // Establish camera direction
     vec3 cameraForward = glm::normalize(scene.camera.dir);
     vec3 cameraRight = scene.camera.rightVector();
     vec3 cameraUp = scene.camera.upVector(cameraRight);
-    vec3 px, py;
 
-    // Create viewing ray
-    Ray ray;
+    current.valid = true;
+    current.camera = scene.camera;
+    current.forward = cameraForward;
+    current.right = cameraRight;
+    current.up = cameraUp;
+    current.light.resize(width * height);
+    current.points.resize(width * height);
+    current.normals.resize(width * height);
+    current.ids.assign(width * height, -1);
+
+    int tile_size = std::max(2, scene.tile_size + (scene.tile_size & 1));
+    int threads = scene.renderThreads();
+    TileScheduler &scheduler = current.scheduler;
+    scheduler.reset(width, height, tile_size, threads);
+    std::atomic<long> reused(0);
+    current.colors.assign(width * height, vec3{0.0, 0.0, 0.0});
+    vec3 *colors = current.colors.data();
+    std::vector<TraversalStats> &traversal = current.traversal;
+    traversal.assign(threads, TraversalStats());
 
     auto start = std::chrono::high_resolution_clock::now();
-    auto recent = start;
 
-    #pragma omp parallel for shared(pixels, buffer) private(px, py, ray)
-    for (int x = 0; x < scene.camera.WIDTH; x++) {
-        for (int y = 0; y < scene.camera.HEIGHT; y++) {
-            
-            // Start with a black pixel
-            vec3 color{0.0, 0.0, 0.0};
+    #pragma omp parallel num_threads(threads) shared(current, history, scheduler, reused, colors, traversal)
+    {
+        int thread = omp_get_thread_num();
+        long thread_reused = 0;
+        takeTraversalStats();
+        int t;
+        while (scheduler.next(thread, t)) {
+            Tile &tile = scheduler.tiles[t];
+            auto tile_start = std::chrono::high_resolution_clock::now();
+
+            for (int by = tile.y; by < tile.y + tile.height; by += 2) {
+                for (int bx = tile.x; bx < tile.x + tile.width; bx += 2) {
+                    Ray rays[PACKET_SIZE];
+                    Intersection collisions[PACKET_SIZE];
+                    float ox, oy;
+                    sampleOffset(CENTER_SAMPLE, 1, ox, oy);
+
+                    int active = 0;
+                    for (int l = 0; l < PACKET_SIZE; l++) {
+                        if (bx + (l & 1) < width && by + (l >> 1) < height) {
+                            active |= (1 << l);
+                        }
+                        cameraRay(rays[l], bx + (l & 1), by + (l >> 1), ox, oy, scene, cameraForward, cameraRight, cameraUp);
+                    }
+
+                    // Visibility is always traced, only shading is reused
+                    closestHits(rays, active, scene.packets, accel, collisions);
+
+                    for (int l = 0; l < PACKET_SIZE; l++) {
+                        const Intersection &collision = collisions[l];
+                        if (!(active & (1 << l)) || !collision.hit) {
+                            continue;
+                        }
+
+                        int i = ((by + (l >> 1)) * width) + bx + (l & 1);
+                        const Shape *o = collision.obj;
+                        const Material &material = *o->material;
+                        vec3 normal = o->surfaceNormal(collision, rays[l]);
+
+                        int old = reuse ? history.find(rays[l], collision, normal) : -1;
+                        if (old >= 0 && dynamicShadow(history.points[old], history.normals[old], scene.lights, accel)) {
+                            old = -1;
+                        }
+
+                        if (material.refractive) {
+                            colors[i] = shade(rays[l], collision, scene.objects, scene.lights, accel);
+                            continue;
+                        }
+
+                        // Shape::surface, with the diffuse light kept or reused
+                        if (old >= 0) {
+                            current.light[i] = history.light[old];
+                            current.points[i] = history.points[old];
+                            current.normals[i] = history.normals[old];
+                            current.ids[i] = history.ids[old];
+                            thread_reused++;
+                        } else {
+                            current.light[i] = material.lambert ? o->diffuseLight(collision.point, normal, scene.objects, scene.lights, accel) : vec3{0.0, 0.0, 0.0};
+                            current.points[i] = collision.point;
+                            current.normals[i] = normal;
+                            current.ids[i] = dynamicShadow(collision.point, normal, scene.lights, accel) ? -1 : o->id;
+                        }
+
+                        vec3 specular_color{0.0, 0.0, 0.0};
+                        if (material.specular) {
+                            specular_color = o->reflection(rays[l], collision.point, normal, scene.objects, scene.lights, accel);
+                        }
+                        colors[i] = ((current.light[i] * o->albedo(rays[l], collision)) * material.lambert) + (specular_color * material.specular);
+                    }
+                }
+            }
+
+            auto tile_end = std::chrono::high_resolution_clock::now();
+            tile.thread = thread;
+            tile.seconds = std::chrono::duration_cast<std::chrono::microseconds>(tile_end - tile_start).count() / 1000000.0;
+        }
+        reused += thread_reused;
+        traversal[thread] = takeTraversalStats();
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+
+    RenderStats stats;
+    stats.primary_rays = width * height;
+    stats.reused_pixels = reused;
+    stats.seconds = (double) duration.count() / 1000000.0;
+    stats.samples_per_pixel = 1.0;
+    stats.threads = threads;
+    stats.steals = scheduler.steals;
+    for (auto &t : traversal) {
+        stats.traversal.add(t);
+    }
+
+    toneMap(buffer, colors, nullptr, 1.0, width * height, scene.tonemap, threads);
+    std::swap(history, current);
+    stats.tiles = &history.scheduler.tiles;
 
-            for (int xx = 1; xx <= scene.AA; xx++) {
-                for (int yy = 1; yy <= scene.AA; yy++) {
+    #ifdef DEBUG
+    std::cout << "Execution time: " << stats.seconds << " seconds" << std::endl;
+    std::cout << "Reused pixels: " << stats.reused_pixels << " of " << stats.primary_rays << std::endl;
+    accel.reportFrame();
+    #ifdef TRAVERSAL_STATS
+    stats.traversal.print(std::cout, stats.primary_rays);
+    #endif
+    #endif
 
-                    // Create ray
-                    ray.origin = scene.camera.origin;
+    return stats;
+}
 
-                    // float px = (2 * ((x + ( (float) xx / (float) (AA + 1)) ) / scene.camera.WIDTH) - 1) * halfWidth * scene.camera.aspectRatio;
-                    // float py = (1 - 2 * ((y + ( (float) yy / (float) (AA + 1)) ) / scene.camera.HEIGHT)) * halfWidth;
+// Add the next count passes to a frame. Rendering stops early when cancel is
+// set, leaving a partial pass, so a cancelled frame has to be reset.
+RenderStats renderPasses(ProgressiveFrame& frame, Scene &scene, Accelerator& accel, int count, std::atomic<bool> *cancel) {
+    #ifdef DEBUG
+    std::cout << "Rendering" << (scene.camera.preview ? " preview" : "") << " passes " << frame.passes + 1 << "-" << frame.passes + count << " of " << frame.total_passes
+              << (frame.adaptive ? " (adaptive)" : "") << std::endl;
+    std::cout << "Camera has width " << scene.camera.WIDTH << " and height " << scene.camera.HEIGHT << std::endl;
+    #endif
+
+    count = std::min(count, frame.total_passes - frame.passes);
+
+    // Establish camera direction
+    vec3 cameraForward = glm::normalize(scene.camera.dir);
+    vec3 cameraRight = scene.camera.rightVector();
+    vec3 cameraUp = scene.camera.upVector(cameraRight);
 
-                    // ray.vector = glm::normalize(vec3{px, py, -1});
+    // Tiles hold whole 2x2 blocks
+    int tile_size = std::max(2, scene.tile_size + (scene.tile_size & 1));
+    int threads = scene.renderThreads();
 
-                    px = cameraRight * (( (x + (float) xx / (float) (scene.AA + 1)) * scene.camera.pixelWidth) - scene.camera.halfWidth) * scene.camera.aspectRatio;
-                    py = cameraUp * (( (y + (float) yy / (float) (scene.AA + 1)) * scene.camera.pixelHeight) - scene.camera.halfHeight);
+    // An adaptive pass needs the whole pass before it, so those are scheduled
+    // one at a time. Otherwise each tile traces all of its samples in one go.
+    int rounds = frame.adaptive ? count : 1;
+    int round_passes = frame.adaptive ? 1 : count;
 
-                    ray.vector = glm::normalize(cameraForward + px + py);
-                    ray.invdir = 1.0f/ray.vector;
+    RenderStats stats;
+    stats.threads = threads;
+    stats.steals = 0;
+    stats.tiles = &frame.scheduler.tiles;
+    long samples_before = totalSamples(frame);
 
-                    // Check for collisions with the scene
-                    color += trace(ray, scene.objects, scene.lights, grid);
+    auto start = std::chrono::high_resolution_clock::now();
 
+    for (int round = 0; round < rounds; round++) {
+        int pass = frame.passes;
+
+        // Pixels to refine, from the centers traced in the first pass
+        std::vector<char> &refine = frame.refine;
+        if (frame.adaptive && pass == 1) {
+            refine.resize(frame.width * frame.height);
+            #pragma omp parallel for num_threads(threads)
+            for (int y = 0; y < frame.height; y++) {
+                for (int x = 0; x < frame.width; x++) {
+                    refine[(y * frame.width) + x] = frame.needsSamples(x, y);
                 }
             }
+        }
 
-            pixels[y*scene.camera.WIDTH + x] = color;
-            buffer[y*scene.camera.WIDTH + x] = vecToHex(color / (float) (scene.AA*scene.AA) );
+        TileScheduler &scheduler = frame.scheduler;
+        scheduler.reset(frame.width, frame.height, tile_size, threads);
+        std::vector<TraversalStats> &traversal = frame.traversal;
+        traversal.assign(threads, TraversalStats());
 
-            // Check for events to prevent the window from not responding
-            if (y == 0) {
-                auto check = std::chrono::high_resolution_clock::now();
-                if (std::chrono::duration_cast<std::chrono::microseconds>(check - recent).count() > 1000000) {
-                    SDL_PumpEvents();
-                    recent = check;
+        #pragma omp parallel num_threads(threads) shared(frame, scheduler, refine, traversal)
+        {
+            int thread = omp_get_thread_num();
+            takeTraversalStats();
+            int t;
+            while (!(cancel != nullptr && *cancel) && scheduler.next(thread, t)) {
+                Tile &tile = scheduler.tiles[t];
+                auto tile_start = std::chrono::high_resolution_clock::now();
+
+                if (!frame.adaptive) {
+                    for (int by = tile.y; by < tile.y + tile.height; by += 2) {
+                        for (int bx = tile.x; bx < tile.x + tile.width; bx += 2) {
+                            renderBlock(bx, by, pass, round_passes, frame, scene, accel, cameraForward, cameraRight, cameraUp);
+                        }
+                    }
+                } else if (pass == 0) {
+                    for (int by = tile.y; by < tile.y + tile.height; by += 2) {
+                        for (int bx = tile.x; bx < tile.x + tile.width; bx += 2) {
+                            renderBlock(bx, by, CENTER_SAMPLE, 1, frame, scene, accel, cameraForward, cameraRight, cameraUp);
+                        }
+                    }
+                } else {
+                    for (int y = tile.y; y < tile.y + tile.height; y++) {
+                        for (int x = tile.x; x < tile.x + tile.width; x++) {
+                            if (refine[(y * frame.width) + x]) {
+                                refinePixel(x, y, frame, scene, accel, cameraForward, cameraRight, cameraUp);
+                            }
+                        }
+                    }
                 }
+
+                auto tile_end = std::chrono::high_resolution_clock::now();
+                tile.thread = thread;
+                tile.seconds = std::chrono::duration_cast<std::chrono::microseconds>(tile_end - tile_start).count() / 1000000.0;
             }
+            traversal[thread] = takeTraversalStats();
         }
-    }
 
-    // convert vec3 vector to a Uint32 array with tone mapping
-    fillBuffer(buffer, pixels, scene.camera.WIDTH * scene.camera.HEIGHT);
+        stats.steals += scheduler.steals;
+        for (auto &t : traversal) {
+            stats.traversal.add(t);
+        }
+
+        if (cancel != nullptr && *cancel) {
+            break;
+        }
+        frame.passes += round_passes;
+    }
 
     auto end = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+
+    stats.primary_rays = totalSamples(frame) - samples_before;
+    stats.reused_pixels = 0;
+    stats.seconds = (double) duration.count() / 1000000.0;
+    stats.samples_per_pixel = frame.samplesPerPixel();
+
     #ifdef DEBUG
-    std::cout << "Execution time: " << (double) duration.count() / 1000000.0 << " seconds" << std::endl;
+    if (cancel != nullptr && *cancel) {
+        std::cout << "Cancelled after " << stats.seconds << " seconds" << std::endl;
+        return stats;
+    }
+
+    std::cout << "Execution time: " << stats.seconds << " seconds" << std::endl;
+    std::cout << "Primary rays: " << stats.primary_rays << " (" << stats.primary_rays / stats.seconds / 1000000.0 << " Mrays/s, "
+              << (scene.packets ? "packets" : "single rays") << ")" << std::endl;
+    std::cout << "Samples per pixel: " << stats.samples_per_pixel << " of " << frame.AA * frame.AA << std::endl;
+
+    // Load balance: time each thread spent rendering tiles
+    std::vector<double> busy(threads, 0.0);
+    double slowest = 0.0;
+    for (auto &tile : *stats.tiles) {
+        busy[tile.thread] += tile.seconds;
+        slowest = std::max(slowest, tile.seconds);
+    }
+    std::cout << "Tiles: " << stats.tiles->size() << " of " << tile_size << "x" << tile_size << " on " << threads << " threads, "
+              << stats.steals << " stolen, slowest " << slowest * 1000.0 << " ms" << std::endl;
+    std::cout << "Thread busy time:";
+    for (double b : busy) {
+        std::cout << " " << b;
+    }
+    std::cout << " seconds" << std::endl;
+    accel.reportFrame();
+    #ifdef TRAVERSAL_STATS
+    stats.traversal.print(std::cout, stats.primary_rays);
+    #endif
     #endif
+
+    return stats;
 }
 
-vec3 trace(const Ray &ray, const vector<Shape*>& objects, const vector<Light*>& lights, Grid& grid) {
+// False color from black through blue, cyan, green and yellow to red as x
+// goes from 0 to 1
+static vec3 heatColor(float x) {
+    static const vec3 stops[] = {{0.0, 0.0, 0.0}, {0.0, 0.0, 1.0}, {0.0, 1.0, 1.0}, {0.0, 1.0, 0.0}, {1.0, 1.0, 0.0}, {1.0, 0.0, 0.0}};
+    const int last = (sizeof(stops) / sizeof(stops[0])) - 1;
 
-    // Return black after 2 bounces
-    if (ray.depth > 4) return vec3{0.0, 0.0, 0.0};
+    float position = glm::clamp(x, 0.0f, 1.0f) * last;
+    int stop = std::min((int) position, last - 1);
+    return glm::mix(stops[stop], stops[stop + 1], position - stop);
+}
 
-    /* ** Traverse grid ** */
-    // Check if ray intersects grid
-    float t_min, t_max;
-    if (!ray.intersectBox(grid.min, grid.max, t_min, t_max)) {
-        return vec3{0.0, 0.0, 0.0};
+// Show each pixel's mean cost per sample. Red is the cost that only one pixel
+// in a hundred exceeds, so a few pixels a thread was preempted in cannot wash
+// out a time heatmap.
+void fillHeatmap(uint32_t *buffer, ProgressiveFrame& frame, int threads) {
+    int size = frame.width * frame.height;
+    std::vector<float> &mean = frame.heat;
+    mean.assign(size, 0.0);
+    double total = 0.0;
+    for (int i = 0; i < size; i++) {
+        if (frame.counts[i] > 0) {
+            mean[i] = frame.cost[i] / frame.counts[i];
+        }
+        total += mean[i];
     }
 
-    // Setup traversal
-    vec3 cell_dimensions = (grid.size) / (vec3) grid.dimensions;
+    std::vector<float> &sorted = frame.heat_order;
+    sorted.assign(mean.begin(), mean.end());
+    auto high = sorted.begin() + (int) ((size - 1) * HEATMAP_PERCENTILE);
+    std::nth_element(sorted.begin(), high, sorted.end());
+    float scale = *high;
 
-    glm::vec3 ray_orig_cell, delta_t, next_crossing_t;
-    glm::ivec3 step, exit, current_cell;
-    for (int i = 0; i < 3; i++) {
-        ray_orig_cell[i] = (ray.origin[i] + (ray.vector[i] * t_min)) - grid.min[i];
-        current_cell[i] = glm::clamp((int) glm::floor(ray_orig_cell[i] / cell_dimensions[i]), 0, grid.dimensions[i] - 1);
-        if (ray.vector[i] < 0) {
-            delta_t[i] = -cell_dimensions[i] * ray.invdir[i];
-            next_crossing_t[i] = t_min + (current_cell[i] * cell_dimensions[i] - ray_orig_cell[i]) * ray.invdir[i];
-            exit[i] = -1;
-            step[i] = -1;
-        } else {
-            delta_t[i] = cell_dimensions[i] * ray.invdir[i];
-            next_crossing_t[i] = t_min + ((current_cell[i] + 1) * cell_dimensions[i] - ray_orig_cell[i]) * ray.invdir[i];
-            exit[i] = grid.dimensions[i];
-            step[i] = 1;
-        }
+    #pragma omp parallel for num_threads(threads)
+    for (int i = 0; i < size; i++) {
+        buffer[i] = vecToHex(heatColor(scale > 0.0 ? mean[i] / scale : 0.0));
     }
 
-    // Traverse grid
-    Intersection collision;
-    while (true) {
-        collision = ray.intersectObjects(grid.at(current_cell.x, current_cell.y, current_cell.z));
+    #ifdef DEBUG
+    static const char *units[] = {"", "cells", "tests", "shadow rays", "microseconds"};
+    std::cout << "Heatmap of " << units[frame.heatmap] << " per sample: " << total / size << " mean, " << scale << " shown as red" << std::endl;
+    #endif
+}
 
-        Uint8 k =   ((next_crossing_t.x < next_crossing_t.y) << 2) + 
-                    ((next_crossing_t.x < next_crossing_t.z) << 1) + 
-                    ((next_crossing_t.y < next_crossing_t.z));
-        static const Uint8 map[8] = {2, 1, 2, 1, 2, 2, 0, 0};
-        Uint8 axis = map[k];
+// Tone map the samples traced so far. Each pixel's sum is scaled up to a full
+// set of AA samples first, so partly refined and adaptive frames are as bright
+// as finished ones.
+void resolveFrame(uint32_t *buffer, ProgressiveFrame& frame, const Scene& scene) {
+    if (frame.passes == 0) {
+        return;
+    }
 
-        if (collision.t < next_crossing_t[axis])
-            break;
+    if (frame.heatmap != HEATMAP_OFF) {
+        fillHeatmap(buffer, frame, scene.renderThreads());
+        return;
+    }
 
-        current_cell[axis] += step[axis];
+    bool complete = frame.done() && !frame.adaptive;
+    toneMap(buffer, frame.samples.data(), complete ? nullptr : frame.counts.data(), frame.AA * frame.AA, frame.width * frame.height, scene.tonemap, scene.renderThreads());
+}
 
-        if (current_cell[axis] == exit[axis])
-            break;
+// Write how long each tile of a frame took as CSV, for load balance studies
+void writeTileTimes(const std::string& path, const RenderStats& stats) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cout << "Failed to write tile times to " << path << std::endl;
+        return;
+    }
 
-        next_crossing_t[axis] += delta_t[axis];
+    out << "x,y,width,height,thread,ms" << std::endl;
+    for (auto &tile : *stats.tiles) {
+        out << tile.x << "," << tile.y << "," << tile.width << "," << tile.height << "," << tile.thread << "," << tile.seconds * 1000.0 << std::endl;
     }
+}
+
+vec3 trace(const Ray &ray, const vector<Shape*>& objects, const vector<Light*>& lights, Accelerator& accel) {
 
+    // Return black after 2 bounces
+    if (ray.depth > 4) return vec3{0.0, 0.0, 0.0};
+
+    COUNT_TRAVERSAL(secondary_rays, 1);
+    TRAVERSAL_DEPTH();
+
+    Intersection collision = accel.intersect(ray);
+
+    return shade(ray, collision, objects, lights, accel);
+}
+
+vec3 shade(const Ray &ray, const Intersection& collision, const vector<Shape*>& objects, const vector<Light*>& lights, Accelerator& accel) {
     if (collision.hit) {
         // get surface details of intersection
         // return {0.1, 0.4, 0.1};
-        return collision.obj->surface(ray, collision.point, objects, lights, grid);
+        return collision.obj->surface(ray, collision, objects, lights, accel);
     }
 
     return vec3{0.0, 0.0, 0.0};
 }
 
+// Trace primary rays together and add their colors. Only finding the closest
+// hit is shared, each hit is shaded on its own and secondary rays are traced
+// one at a time. ids, if given, receives the id of the object each ray hits.
+void tracePacket(const Ray *rays, int active, const vector<Shape*>& objects, const vector<Light*>& lights, Accelerator& accel, vec3 *colors, int *ids) {
+    Intersection collisions[PACKET_SIZE];
+    closestHits(rays, active, true, accel, collisions);
+
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (!(active & (1 << l)) || !collisions[l].hit) {
+            continue;
+        }
+
+        colors[l] += shade(rays[l], collisions[l], objects, lights, accel);
+        if (ids != nullptr) {
+            ids[l] = collisions[l].obj->id;
+        }
+    }
+}
+
+/* TONE MAPPING */
 // from https://computergraphics.stackexchange.com/questions/6307/tone-mapping-bright-images
-float hable(float x) {
-    float A = 0.15;
-    float B = 0.50;
-    float C = 0.10;
-    float D = 0.20;
-    float E = 0.02;
-    float F = 0.30;
+class FilmicCurve {
+public:
+
+    static __m128 apply(__m128 x) {
+        const __m128 A = _mm_set1_ps(0.15);
+        const __m128 B = _mm_set1_ps(0.50);
+        const __m128 CB = _mm_set1_ps(0.10 * 0.50);
+        const __m128 DE = _mm_set1_ps(0.20 * 0.02);
+        const __m128 DF = _mm_set1_ps(0.20 * 0.30);
+        const __m128 E_F = _mm_set1_ps(0.02 / 0.30);
+
+        __m128 ax = _mm_mul_ps(A, x);
+        __m128 top = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(ax, CB)), DE);
+        __m128 bottom = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(ax, B)), DF);
+        return _mm_sub_ps(_mm_div_ps(top, bottom), E_F);
+    }
 
-    return ((x*(A*x+C*B)+D*E)/(x*(A*x+B)+D*F))-E/F;
+};
+
+class ReinhardCurve {
+public:
+
+    static __m128 apply(__m128 x) {
+        return _mm_div_ps(x, _mm_add_ps(x, _mm_set1_ps(1.0)));
+    }
+
+};
+
+// Colors of four pixels from pixels[i], one channel per register. Each sum is
+// scaled up to full samples when counts are given.
+static inline void loadPixels(const vec3 *pixels, const int *counts, float full, int i, __m128 &r, __m128 &g, __m128 &b) {
+    const float *p = &pixels[i].x;
+    __m128 a0 = _mm_loadu_ps(p); // r0 g0 b0 r1
+    __m128 a1 = _mm_loadu_ps(p + 4); // g1 b1 r2 g2
+    __m128 a2 = _mm_loadu_ps(p + 8); // b2 r3 g3 b3
+
+    r = _mm_shuffle_ps(a0, _mm_shuffle_ps(a1, a2, _MM_SHUFFLE(0, 1, 0, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+    g = _mm_shuffle_ps(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(a1, a2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+    b = _mm_shuffle_ps(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(a2, a2, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+
+    if (counts != nullptr) {
+        // Pixels without samples are black, whatever they are scaled by
+        __m128 n = _mm_max_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (counts + i))), _mm_set1_ps(1.0));
+        __m128 scale = _mm_div_ps(_mm_set1_ps(full), n);
+        r = _mm_mul_ps(r, scale);
+        g = _mm_mul_ps(g, scale);
+        b = _mm_mul_ps(b, scale);
+    }
 }
 
-void fillBuffer(Uint32 *buffer, std::vector<vec3> pixels, int size) {
-    #pragma omp parallel for shared(pixels)
-    for (int i = 0; i < size; i++) {
-        // pixels[i] /= (pixels[i] + 0.25f);
-        for (int j = 0 ; j < 3; j++) {
-            pixels[i][j] = hable(pixels[i][j]);
-        }
-    }
-
-    // float maxI = 0.00001;
-    // float I;
-    // #pragma omp parallel for private(I) shared(maxI, pixels)
-    // for (int i = 0; i < size; i++) {
-    //     I = (0.3 * pixels[i].r) + (0.5 * pixels[i].g) + (0.2 * pixels[i].b);
-    //     #pragma omp critical
-    //     {
-    //         if (I > maxI) {
-    //             maxI = I;
-    //         }
-    //     }
-    // }
-
-    float I;
-    float averageI;
-    #pragma omp parallel for private(I) shared(averageI, pixels)
-    for (int i = 0; i < size; i++) {
-        I = (0.3 * pixels[i].r) + (0.5 * pixels[i].g) + (0.2 * pixels[i].b);
-        #pragma omp critical
-        {
-            averageI += (I / (float) size);
+// The last size % 4 pixels, padded out with black
+static inline void loadLastPixels(const vec3 *pixels, const int *counts, float full, int i, int size, __m128 &r, __m128 &g, __m128 &b) {
+    vec3 last[4] = {vec3{0.0, 0.0, 0.0}, vec3{0.0, 0.0, 0.0}, vec3{0.0, 0.0, 0.0}, vec3{0.0, 0.0, 0.0}};
+    int last_counts[4] = {0, 0, 0, 0};
+    for (int j = i; j < size; j++) {
+        last[j - i] = pixels[j];
+        last_counts[j - i] = (counts != nullptr) ? counts[j] : 0;
+    }
+    loadPixels(last, (counts != nullptr) ? last_counts : nullptr, full, 0, r, g, b);
+}
+
+// Expose four curved pixels so the frame's mean brightness is mult times its
+// own, compress them once more, and pack them as 0xRRGGBB
+static inline __m128i packPixels(__m128 r, __m128 g, __m128 b, __m128 mult) {
+    const __m128 knee = _mm_set1_ps(0.65);
+    const __m128 one = _mm_set1_ps(1.0);
+    const __m128 max = _mm_set1_ps(255.0);
+
+    r = _mm_mul_ps(r, mult);
+    g = _mm_mul_ps(g, mult);
+    b = _mm_mul_ps(b, mult);
+    r = _mm_min_ps(_mm_div_ps(r, _mm_add_ps(r, knee)), one);
+    g = _mm_min_ps(_mm_div_ps(g, _mm_add_ps(g, knee)), one);
+    b = _mm_min_ps(_mm_div_ps(b, _mm_add_ps(b, knee)), one);
+
+    __m128i ir = _mm_cvttps_epi32(_mm_mul_ps(r, max));
+    __m128i ig = _mm_cvttps_epi32(_mm_mul_ps(g, max));
+    __m128i ib = _mm_cvttps_epi32(_mm_mul_ps(b, max));
+    return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(ir, 16), _mm_slli_epi32(ig, 8)), ib);
+}
+
+static inline __m128 brightness(__m128 r, __m128 g, __m128 b) {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.3), r), _mm_mul_ps(_mm_set1_ps(0.5), g)), _mm_mul_ps(_mm_set1_ps(0.2), b));
+}
+
+// Tone map with one curve, four pixels at a time. The first pass sums the
+// curved brightness of each chunk of the frame, and the second curves each
+// pixel again rather than keep it, exposes it and packs it into the buffer.
+template <typename Curve>
+static void toneMapWith(uint32_t *buffer, const vec3 *pixels, const int *counts, float full, int size, int threads) {
+    int whole = size - (size % 4);
+    int chunk = (((size + 3) / 4) + TONEMAP_CHUNKS - 1) / TONEMAP_CHUNKS * 4;
+    double sums[TONEMAP_CHUNKS];
+
+    #pragma omp parallel for num_threads(threads) shared(sums)
+    for (int c = 0; c < TONEMAP_CHUNKS; c++) {
+        __m128 r, g, b;
+        __m128 sum = _mm_setzero_ps();
+        int end = std::min((c + 1) * chunk, whole);
+        for (int i = c * chunk; i < end; i += 4) {
+            loadPixels(pixels, counts, full, i, r, g, b);
+            sum = _mm_add_ps(sum, brightness(Curve::apply(r), Curve::apply(g), Curve::apply(b)));
         }
+
+        float lanes[4];
+        _mm_storeu_ps(lanes, sum);
+        sums[c] = (double) lanes[0] + lanes[1] + lanes[2] + lanes[3];
     }
 
-    // float mult = 1.0/maxI;
-    float mult = 0.5/averageI;
-    #pragma omp parallel for shared(pixels)
-    for (int i = 0; i < size; i++) {
-        pixels[i] *= mult;
-        pixels[i] /= (pixels[i] + 0.65f);
-        if (pixels[i].r > 1.0) pixels[i].r = 1.0;
-        if (pixels[i].g > 1.0) pixels[i].g = 1.0;
-        if (pixels[i].b > 1.0) pixels[i].b = 1.0;
+    __m128 r, g, b;
+    double total = 0.0;
+    for (int c = 0; c < TONEMAP_CHUNKS; c++) {
+        total += sums[c];
+    }
+    if (whole < size) {
+        float lanes[4];
+        loadLastPixels(pixels, counts, full, whole, size, r, g, b);
+        _mm_storeu_ps(lanes, brightness(Curve::apply(r), Curve::apply(g), Curve::apply(b)));
+        total += (double) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    // A black frame stays black
+    float average = (size > 0) ? total / size : 0.0;
+    __m128 mult = _mm_set1_ps((average > 0.0f) ? 0.5 / average : 0.0);
 
-        buffer[i] = vecToHex(pixels[i]);
+    #pragma omp parallel for num_threads(threads)
+    for (int i = 0; i < whole; i += 4) {
+        __m128 r, g, b;
+        loadPixels(pixels, counts, full, i, r, g, b);
+        _mm_storeu_si128((__m128i*) (buffer + i), packPixels(Curve::apply(r), Curve::apply(g), Curve::apply(b), mult));
+    }
+    if (whole < size) {
+        uint32_t last[4];
+        loadLastPixels(pixels, counts, full, whole, size, r, g, b);
+        _mm_storeu_si128((__m128i*) last, packPixels(Curve::apply(r), Curve::apply(g), Curve::apply(b), mult));
+        std::copy(last, last + (size - whole), buffer + whole);
+    }
+}
+
+// Write size pixel colors to the buffer for display, each exposed so the
+// frame's mean brightness is the same from frame to frame. Where counts are
+// given, each pixel is a sum of counts[i] samples and is scaled up to full
+// samples first. Allocates nothing.
+void toneMap(uint32_t *buffer, const vec3 *pixels, const int *counts, float full, int size, ToneMapOperator op, int threads) {
+    static_assert(sizeof(vec3) == 3 * sizeof(float), "Pixels are read as packed floats");
+
+    switch (op) {
+        case TONEMAP_REINHARD:
+            toneMapWith<ReinhardCurve>(buffer, pixels, counts, full, size, threads);
+            break;
+        default:
+            toneMapWith<FilmicCurve>(buffer, pixels, counts, full, size, threads);
+            break;
     }
 }
 
-void redOutline(Uint32 *buffer, int width, int height, int thickness) {
-    Uint32 redColor = (((Uint32) 255) << 16) + (((Uint32) 51) << 8) + ((Uint32) 51);
+void redOutline(uint32_t *buffer, int width, int height, int thickness) {
+    uint32_t redColor = (((uint32_t) 255) << 16) + (((uint32_t) 51) << 8) + ((uint32_t) 51);
     for (int i = 0; i < width*thickness; i++) {
         buffer[i] = redColor;
     }
@@ -2,15 +2,23 @@
 #define __raytrace_HPP__
 
 #include <vector>
-#include <SDL2/SDL.h>
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <emmintrin.h>
 #include <glm/vec3.hpp>
 #include "rapidjson/document.h"
 #include "CImg.h"
+#include "bvh.hpp"
+#include "arena.hpp"
+#include "texture.hpp"
+#include "traversalstats.hpp"
 
 class Shape;
+class Sphere;
 class Triangle;
 class Intersection;
-class Grid;
+class Accelerator;
 
 class Ray {
 public:
@@ -24,8 +32,12 @@ public:
     glm::vec3 invdir;
     float IoR;
     int depth;
+    float cone; // Width of the ray's footprint at its origin, for texture filtering
+    float spread; // How fast the footprint widens with distance, 0 for rays that need none
 
     Intersection intersectObjects(const std::vector<Shape*>& objects) const;
+    bool intersectObjects(const std::vector<Shape*>& objects, int first, int count, Intersection &collision) const;
+    bool intersectObject(Shape *o, Intersection &collision) const;
     bool intersectBox(const glm::vec3 min, const glm::vec3 max, float &tmin, float &tmax) const;
 
 };
@@ -37,8 +49,34 @@ public:
     Shape *obj;
     glm::vec3 point;
     float t;
+    float u, v; // Barycentric coordinates of a triangle hit
+    int primitive; // Triangle of a model hit, -1 for other shapes
+
+    Intersection() {hit = false; t = 10000.0; u = v = 0.0; primitive = -1;}
+};
+
+const int PACKET_SIZE = 4;
+
+// Coherent rays traced together, one SSE lane per ray
+class RayPacket {
+public:
+
+    Ray rays[PACKET_SIZE];
+    float ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];
+    float dx[PACKET_SIZE], dy[PACKET_SIZE], dz[PACKET_SIZE];
+    float ix[PACKET_SIZE], iy[PACKET_SIZE], iz[PACKET_SIZE];
+    int active; // Bit mask of lanes holding a ray
+
+    // Closest hit of each ray, and the triangle hit for models
+    float t[PACKET_SIZE];
+    Shape *hit[PACKET_SIZE];
+    int primitive[PACKET_SIZE];
+
+    RayPacket(const Ray *r, int mask);
+
+    int intersectBox(const glm::vec3& min, const glm::vec3& max, float &t_entry) const;
+    void record(int mask, __m128 t_hit, Shape *o);
 
-    Intersection() {hit = false; t = 10000.0;}
 };
 
 class Camera {
@@ -79,16 +117,33 @@ public:
     Camera();
     Camera(int w, int h, float FOV);
 
+    void setResolution(int full_width, int full_height, int preview_width, int preview_height);
     void setPreview(bool b);
     void setView(float FOV);
     void move(const glm::vec3 pos, const glm::vec3 point);
     void translate(const glm::vec3 move_by);
     void setAngle(const float theta, const float phi);
+    void placeSprite();
     glm::vec3 rightVector() const;
     glm::vec3 upVector(glm::vec3 right) const;
 
 };
 
+// How a surface shades, shared by every object made of it. Objects point
+// into their scene's table, so editing an entry restyles all of them.
+class Material {
+public:
+
+    float lambert;
+    float specular;
+    bool refractive;
+    float IoR;
+
+    Material();
+    Material(float lam, float spec, bool refr, float ior);
+
+};
+
 class Light {
 public:
 
@@ -97,44 +152,366 @@ public:
 
     Light(glm::vec3 p, glm::vec3 c);
 
-    bool visible(const glm::vec3& point, const std::vector<Shape*>& objects, Grid &grid, glm::vec3& normal) const;
+    bool visible(const glm::vec3& point, const std::vector<Shape*>& objects, Accelerator &accel, const glm::vec3& normal) const;
+
+};
 
+// What a heatmap frame shows at each pixel in place of its color
+enum HeatmapMode {
+    HEATMAP_OFF,
+    HEATMAP_CELLS, // Grid cells visited
+    HEATMAP_TESTS, // Scene object and model triangle tests
+    HEATMAP_SHADOW_RAYS,
+    HEATMAP_TIME // Microseconds spent tracing and shading
+};
+
+// Curves that compress a frame's colors before it is exposed for display
+enum ToneMapOperator {
+    TONEMAP_FILMIC, // Hable's filmic curve
+    TONEMAP_REINHARD // x / (1 + x)
 };
 
 class Scene {
 public:
 
+    Arena arena; // Holds the objects and lights, and frees them with the scene
     Camera camera;
     std::vector<Shape*> objects;
     std::vector<Light*> lights;
-    std::vector<cimg_library::CImg<float>> textures;
+    std::vector<Material> materials; // Filled before any object is made, and never resized after, since objects point into it
+    std::vector<std::shared_ptr<Texture>> textures;
     int AA;
+    bool adaptive; // Trace more than one sample only where a pixel needs it
+    float aa_threshold; // Relative contrast or deviation that calls for more samples
+    bool packets; // Trace primary rays in packets
+    bool reproject; // Reuse the last preview's shading where it still applies
+    bool mipmaps; // Blur textures to the size of a pixel where they are seen
+    int tile_size; // Pixels along each side of a render tile
+    int threads; // Render threads, 0 for the OpenMP default
+    HeatmapMode heatmap; // Render what each pixel costs instead of its color
+    ToneMapOperator tonemap;
 
     Scene(int w, int h, float fov, int total_objects, int total_lights);
 
+    int renderThreads() const;
+
+};
+
+// Sphere and triangle copies laid out for tight, non-virtual test loops. The
+// scene object is only followed for the closest hit.
+class SphereData {
+public:
+
+    glm::vec3 center;
+    float radius;
+    Shape *shape;
+    int id;
+
+    SphereData(const Sphere& sphere);
+
+    bool intersect(const Ray& ray, float &t) const;
+    void intersectPacket(RayPacket& packet) const;
+
 };
 
-class Grid {
+class TriangleData {
+public:
+
+    glm::vec3 v0;
+    glm::vec3 e1; // v1 - v0
+    glm::vec3 e2; // v2 - v0
+    Shape *shape;
+    int id;
+
+    TriangleData(const Triangle& triangle);
+    TriangleData(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, Shape *s, int i);
+
+    bool intersect(const Ray& ray, float &t, float &u, float &v) const;
+    void intersectPacket(RayPacket& packet) const;
+
+};
+
+// The part of a PrimitiveList belonging to one grid cell or BVH leaf
+class PrimitiveRange {
+public:
+
+    int sphere_first, sphere_count;
+    int triangle_first, triangle_count;
+    int other_first, other_count;
+
+};
+
+// Scene objects grouped by type, so each group is tested in its own loop.
+// Objects without a data form, such as models, are kept as pointers.
+class PrimitiveList {
+public:
+
+    std::vector<SphereData> spheres;
+    std::vector<TriangleData> triangles;
+    std::vector<Shape *> others;
+
+    PrimitiveRange add(Shape * const *objects, int count);
+    void ids(const PrimitiveRange& range, std::vector<int>& out) const;
+
+    template <typename SkipFunc>
+    bool intersect(const Ray& ray, const PrimitiveRange& range, Intersection &collision, SkipFunc skip) const;
+    template <typename SkipFunc>
+    bool occluded(const Ray& ray, const PrimitiveRange& range, float t_max, SkipFunc skip) const;
+    template <typename SkipFunc>
+    void intersectPacket(RayPacket& packet, const PrimitiveRange& range, SkipFunc skip) const;
+
+};
+
+// Spatial structure that finds the closest object along a ray
+class Accelerator {
+public:
+
+    // Objects that move every frame (the camera sprite), tested on every ray
+    std::vector<Shape *> dynamic;
+
+    virtual ~Accelerator();
+
+    virtual Intersection intersect(const Ray& ray) = 0;
+    virtual void intersectPacket(RayPacket& packet) = 0;
+    virtual bool occluded(const glm::vec3& origin, const glm::vec3& dir, float t_max) = 0;
+    virtual void reportFrame();
+};
+
+// A ray's position while walking through the grid
+class GridCursor {
+public:
+
+    glm::ivec3 cell;
+    glm::ivec3 step;
+    glm::ivec3 exit;
+    glm::vec3 delta_t;
+    glm::vec3 next_crossing_t;
+
+    int nextAxis() const;
+    bool advance(int axis);
+
+};
+
+// Target number of grid cells per object when sizing a grid automatically
+const float GRID_DENSITY = 2.0;
+// Axes at least this fraction of the longest one always get two or more cells
+const float GRID_SPLIT_EXTENT = 0.1;
+const int GRID_MAX_RESOLUTION = 64;
+
+class Grid : public Accelerator {
 public:
 
     glm::vec3 size;
     glm::ivec3 dimensions;
     std::vector<std::vector<Shape *>> cells;
+    std::vector<PrimitiveRange> cell_ranges; // Each cell's objects in primitives
+    PrimitiveList primitives;
     glm::vec3 min;
     glm::vec3 max;
+    int mailbox_size;
+
+    // Object tests made and skipped by mailboxing since the last report
+    std::atomic<long> tests;
+    std::atomic<long> skipped;
 
     Grid(glm::vec3 s, glm::ivec3 dim, glm::vec3 grid_min, glm::vec3 grid_max);
 
+    static glm::ivec3 resolution(glm::vec3 s, int primitives);
+    void fill(const std::vector<Shape*>& objects);
+    void pack();
+    void printStats() const;
+
     std::vector<Shape *>& at(int x, int y, int z);
+    Intersection intersect(const Ray& ray) override;
+    void intersectPacket(RayPacket& packet) override;
+    bool occluded(const glm::vec3& origin, const glm::vec3& dir, float t_max) override;
+    void reportFrame() override;
+
+private:
+
+    bool enter(const Ray& ray, GridCursor &cursor) const;
+
+    template <typename CellFunc, typename StopFunc>
+    void walk(const Ray& ray, CellFunc visit, StopFunc stop);
+};
+
+// Top level BVH over the scene objects. Models are leaves that traverse their
+// own triangle BVH.
+class SceneBVH : public Accelerator {
+public:
+
+    BVH bvh;
+    std::vector<Shape *> objects;
+    std::vector<PrimitiveRange> leaf_ranges; // Each leaf's objects in primitives
+    PrimitiveList primitives;
+
+    SceneBVH();
+
+    void build(const std::vector<Shape*>& scene_objects);
+    Intersection intersect(const Ray& ray) override;
+    void intersectPacket(RayPacket& packet) override;
+    bool occluded(const glm::vec3& origin, const glm::vec3& dir, float t_max) override;
+};
+
+const int DEFAULT_TILE_SIZE = 16;
+
+// A block of pixels rendered by one thread, timed once it is done
+class Tile {
+public:
+
+    int x, y;
+    int width, height;
+    int thread;
+    double seconds;
+
+};
+
+// Tiles in Morton order, split into one contiguous range per thread so each
+// thread works on a compact part of the image. A thread takes tiles from the
+// front of its own range and, once that is empty, steals from the back of
+// the others.
+//
+// A scheduler is kept with the frame it renders and reset for each pass,
+// reusing its lists. It is moved only between passes.
+class TileScheduler {
+public:
+
+    std::vector<Tile> tiles;
+    std::atomic<int> steals;
+
+    TileScheduler();
+    TileScheduler(TileScheduler&& other);
+    TileScheduler& operator=(TileScheduler&& other);
+
+    void reset(int width, int height, int tile_size, int threads);
+    bool next(int thread, int &tile);
+
+private:
+
+    // First and one past last tile of a range, packed so both ends move with
+    // one compare and swap. Padded to keep ranges on separate cache lines.
+    class Range {
+    public:
+        std::atomic<uint64_t> bounds;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    std::vector<Range> ranges; // Never shrunk, only the first range_count are used
+    int range_count;
+    std::vector<std::pair<unsigned int, int>> order; // Morton code and row major index of each tile
+
+    bool takeFront(int range, int &tile);
+    bool takeBack(int range, int &tile);
+
+};
+
+class RenderStats {
+public:
+
+    long primary_rays;
+    long reused_pixels; // Taken from the last frame instead of being shaded
+    double seconds;
+    double samples_per_pixel; // Of the frame so far
+    int threads;
+    int steals;
+    const std::vector<Tile> *tiles; // Of the last pass, kept by the frame or history rendered until its next pass
+    TraversalStats traversal; // Summed over the render threads
+
 };
 
-void render(Uint32 *buffer, rapidjson::Document &scene, Grid& grid);
+const float DEFAULT_AA_THRESHOLD = 0.1;
+
+// Fraction of a heatmap's pixels at or below the cost shown as red
+const float HEATMAP_PERCENTILE = 0.99;
+
+// Sums of a frame's samples, kept between passes so the frame can be shown
+// before all of them are traced. Each pass adds one AA sample to every pixel.
+// An adaptive frame instead traces the pixel centers in its first pass, and
+// in its second adds samples only to pixels that differ from a neighbour or
+// whose samples disagree. A heatmap frame also sums what tracing each
+// sample cost, and shows the mean cost per sample once resolved.
+class ProgressiveFrame {
+public:
+
+    int width, height;
+    int AA;
+    bool adaptive;
+    float threshold;
+    int passes; // Passes finished
+    int total_passes;
+    std::vector<glm::vec3> samples;
+    std::vector<int> counts; // Samples in each pixel's sum
+    std::vector<int> ids; // Object seen through each pixel's center, -1 for none
+    std::vector<int> refine_order; // AA grid samples added to a pixel, corners first
+    HeatmapMode heatmap;
+    std::vector<float> cost; // Summed over each pixel's samples, empty without a heatmap
+
+    // Working space kept between frames, so rendering and resolving one
+    // allocates nothing once the frame size settles
+    std::vector<char> refine; // Pixels the second adaptive pass adds samples to
+    std::vector<float> heat, heat_order; // Mean cost of each pixel, and a copy to find the percentile in
+    std::vector<TraversalStats> traversal; // One per render thread
+    TileScheduler scheduler;
+
+    ProgressiveFrame();
+
+    void reset(int w, int h, int aa, bool adapt = false, float thresh = DEFAULT_AA_THRESHOLD, HeatmapMode heat = HEATMAP_OFF);
+    bool done() const;
+    bool needsSamples(int x, int y) const;
+    double samplesPerPixel() const;
+
+};
+
+// Diffuse lighting of the last preview, kept so the next one only traces
+// shadow rays for what it has not seen before. A pixel is reused when its
+// viewing ray hits the same object within half a pixel of a point the history
+// lit, on the same side. Only the light is kept: the surface color is looked
+// up again so textures stay sharp, and reflections, which change with the
+// view, are traced every frame. Refractive surfaces are never kept, and
+// neither are points that an object moving with the camera shadows in either
+// frame.
+//
+// Callers keep two histories, the last preview's and one the next preview is
+// rendered into, which trade places after each preview so neither is
+// allocated again.
+class FrameHistory {
+public:
+
+    bool valid;
+    Camera camera; // View the history was rendered from
+    glm::vec3 forward, right, up;
+    std::vector<glm::vec3> light; // Diffuse light reaching each point
+    std::vector<glm::vec3> points; // Where the light was found
+    std::vector<glm::vec3> normals;
+    std::vector<int> ids; // Object shaded, -1 if the pixel cannot be reused
+    std::vector<glm::vec3> colors; // Before tone mapping
+    std::vector<TraversalStats> traversal; // One per render thread
+    TileScheduler scheduler;
+
+    FrameHistory();
+
+    int find(const Ray& ray, const Intersection& collision, const glm::vec3& normal) const;
+
+};
+
+RenderStats render(uint32_t *buffer, Scene &scene, Accelerator& accel, ProgressiveFrame& frame);
+RenderStats renderReprojected(uint32_t *buffer, Scene &scene, Accelerator& accel, FrameHistory& history, FrameHistory& current);
+RenderStats renderPasses(ProgressiveFrame& frame, Scene &scene, Accelerator& accel, int count, std::atomic<bool> *cancel);
+void resolveFrame(uint32_t *buffer, ProgressiveFrame& frame, const Scene& scene);
+void fillHeatmap(uint32_t *buffer, ProgressiveFrame& frame, int threads);
+void writeTileTimes(const std::string& path, const RenderStats& stats);
+
+glm::vec3 trace(const Ray &r, const std::vector<Shape*>& objects, const std::vector<Light*>& lights, Accelerator& accel);
+glm::vec3 shade(const Ray &r, const Intersection& collision, const std::vector<Shape*>& objects, const std::vector<Light*>& lights, Accelerator& accel);
+void tracePacket(const Ray *rays, int active, const std::vector<Shape*>& objects, const std::vector<Light*>& lights, Accelerator& accel, glm::vec3 *colors, int *ids = nullptr);
 
-glm::vec3 trace(const Ray &r, const std::vector<Shape*>& objects, const std::vector<Light*>& lights, Grid& grid);
+// Parts a frame's brightness is summed in, each by one thread, so the sum is
+// the same however many threads there are
+const int TONEMAP_CHUNKS = 64;
 
-void fillBuffer(Uint32 *buffer, std::vector<glm::vec3> pixels, int size);
+void toneMap(uint32_t *buffer, const glm::vec3 *pixels, const int *counts, float full, int size, ToneMapOperator op, int threads);
 
-void redOutline(Uint32 *buffer, int width, int height, int thickness);
+void redOutline(uint32_t *buffer, int width, int height, int thickness);
 
 #include "raytrace.cpp"
 
@@ -0,0 +1,169 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <SDL2/SDL.h>
+#include "renderthread.hpp"
+
+/* RENDER THREAD CLASS */
+RenderThread::RenderThread(Scene &s, Accelerator &a, int aa, const std::string &times) :
+    scene(s), accel(a), AA(aa), tile_times(times), thread(NULL), cancel(false), pending(false), quit(false), shown_preview(true), fresh(false) {
+    frame_event = SDL_RegisterEvents(1);
+    lock = SDL_CreateMutex();
+    wake = SDL_CreateCond();
+}
+
+RenderThread::~RenderThread() {
+    stop();
+    SDL_DestroyCond(wake);
+    SDL_DestroyMutex(lock);
+}
+
+void RenderThread::start() {
+    thread = SDL_CreateThread(run, "render", this);
+    if (thread == NULL) {
+        std::cout << "ERROR: " << SDL_GetError() << std::endl;
+    }
+}
+
+// Cancel the current frame and wait for the thread to finish
+void RenderThread::stop() {
+    if (thread == NULL) {
+        return;
+    }
+
+    SDL_LockMutex(lock);
+    quit = true;
+    cancel = true;
+    SDL_CondSignal(wake);
+    SDL_UnlockMutex(lock);
+
+    SDL_WaitThread(thread, NULL);
+    thread = NULL;
+}
+
+void RenderThread::request(const RenderRequest &r) {
+    SDL_LockMutex(lock);
+    next = r;
+    pending = true;
+    cancel = true;
+    SDL_CondSignal(wake);
+    SDL_UnlockMutex(lock);
+}
+
+// Copy the newest frame into the buffer matching its size, false if there is
+// no frame that has not been taken already
+bool RenderThread::takeFrame(bool &preview, Uint32 *preview_pixels, Uint32 *pixels) {
+    SDL_LockMutex(lock);
+    bool found = fresh;
+    if (fresh) {
+        preview = shown_preview;
+        std::copy(shown.begin(), shown.end(), preview ? preview_pixels : pixels);
+        fresh = false;
+    }
+    SDL_UnlockMutex(lock);
+
+    return found;
+}
+
+int RenderThread::run(void *data) {
+    static_cast<RenderThread*>(data)->loop();
+    return 0;
+}
+
+// Render previews as they are requested, and refine the detailed frame one pass
+// at a time until it is done or another request arrives
+void RenderThread::loop() {
+    std::vector<Uint32> preview_buffer(scene.camera.PREVIEW_WIDTH * scene.camera.PREVIEW_HEIGHT);
+    std::vector<Uint32> buffer(scene.camera.FULL_WIDTH * scene.camera.FULL_HEIGHT);
+
+    ProgressiveFrame frame;
+    ProgressiveFrame preview_frame; // For heatmap previews
+    FrameHistory history, next_history;
+    bool refining = false;
+    auto last_present = std::chrono::steady_clock::now();
+
+    while (true) {
+        RenderRequest r;
+        bool started = false;
+
+        SDL_LockMutex(lock);
+        while (!pending && !quit && !refining) {
+            SDL_CondWait(wake, lock);
+        }
+        if (quit) {
+            SDL_UnlockMutex(lock);
+            return;
+        }
+        if (pending) {
+            r = next;
+            pending = false;
+            cancel = false;
+            started = true;
+        }
+        SDL_UnlockMutex(lock);
+
+        if (started) {
+            scene.camera.origin = r.origin;
+            scene.camera.dir = r.dir;
+            scene.packets = r.packets;
+            if (r.place_sprite) {
+                scene.camera.placeSprite();
+            }
+
+            scene.camera.setPreview(r.preview);
+            if (r.preview) {
+                scene.AA = 1;
+                if (scene.heatmap != HEATMAP_OFF) {
+                    render(preview_buffer.data(), scene, accel, preview_frame);
+                } else {
+                    renderReprojected(preview_buffer.data(), scene, accel, history, next_history);
+                }
+                publish(preview_buffer, true);
+                refining = false;
+            } else {
+                scene.AA = AA;
+                frame.reset(scene.camera.WIDTH, scene.camera.HEIGHT, AA, scene.adaptive, scene.aa_threshold, scene.heatmap);
+                last_present = std::chrono::steady_clock::now();
+                refining = true;
+            }
+            continue;
+        }
+
+        RenderStats stats = renderPasses(frame, scene, accel, 1, &cancel);
+        if (cancel) {
+            continue;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (frame.passes == 1 || frame.done() || std::chrono::duration_cast<std::chrono::milliseconds>(now - last_present).count() >= PROGRESSIVE_PRESENT_MS) {
+            resolveFrame(buffer.data(), frame, scene);
+            publish(buffer, false);
+            last_present = now;
+        }
+
+        if (frame.done()) {
+            refining = false;
+            if (!tile_times.empty()) {
+                writeTileTimes(tile_times, stats);
+            }
+        }
+    }
+}
+
+// Hand a frame to the event loop, waking it unless it has yet to take the last one
+void RenderThread::publish(const std::vector<Uint32> &buffer, bool preview) {
+    SDL_LockMutex(lock);
+    bool notify = !fresh;
+    shown = buffer;
+    shown_preview = preview;
+    fresh = true;
+    SDL_UnlockMutex(lock);
+
+    if (notify) {
+        SDL_Event event;
+        SDL_zero(event);
+        event.type = frame_event;
+        SDL_PushEvent(&event);
+    }
+}
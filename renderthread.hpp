@@ -0,0 +1,72 @@
+#ifndef __RENDERTHREAD_HPP__
+#define __RENDERTHREAD_HPP__
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <SDL2/SDL.h>
+#include <glm/vec3.hpp>
+#include "raytrace.hpp"
+
+// Time between showing a hi-resolution frame that is still being refined
+const int PROGRESSIVE_PRESENT_MS = 250;
+
+// A view to render, sent from the event loop
+class RenderRequest {
+public:
+
+    glm::vec3 origin;
+    glm::vec3 dir;
+    bool preview;
+    bool packets;
+    bool place_sprite; // Move the camera sprite behind the new view
+
+};
+
+// Renders on its own thread so the event loop can sleep until there is input
+// or a frame to show. The scene and accelerator belong to this thread once it
+// starts. A new request replaces one that has not started and cancels the one
+// being rendered. Finished frames are announced with an SDL event of type
+// frame_event and picked up with takeFrame.
+class RenderThread {
+public:
+
+    Uint32 frame_event;
+
+    RenderThread(Scene &scene, Accelerator &accel, int AA, const std::string &tile_times);
+    ~RenderThread();
+
+    void start();
+    void stop();
+    void request(const RenderRequest &r);
+    bool takeFrame(bool &preview, Uint32 *preview_pixels, Uint32 *pixels);
+
+private:
+
+    Scene &scene;
+    Accelerator &accel;
+    int AA; // Samples per side for the detailed frame
+    std::string tile_times;
+
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_cond *wake;
+    std::atomic<bool> cancel;
+
+    // Guarded by lock
+    RenderRequest next;
+    bool pending;
+    bool quit;
+    std::vector<Uint32> shown;
+    bool shown_preview;
+    bool fresh; // shown holds a frame not taken yet
+
+    static int run(void *data);
+    void loop();
+    void publish(const std::vector<Uint32> &buffer, bool preview);
+
+};
+
+#include "renderthread.cpp"
+
+#endif
@@ -0,0 +1,175 @@
+#include <iostream>
+#include <map>
+#include <cmath>
+#include <algorithm>
+#include <glm/common.hpp>
+#include "texture.hpp"
+
+// Textures read so far by path, each with the size and time of its file
+static std::map<std::string, std::pair<SceneSource, std::shared_ptr<Texture>>> texture_library;
+
+static inline uint32_t packTexel(float r, float g, float b, float a) {
+    auto byte = [](float c) { return (uint32_t) std::min(std::max(c + 0.5f, 0.0f), 255.0f); };
+    return byte(r) | (byte(g) << 8) | (byte(b) << 16) | (byte(a) << 24);
+}
+
+static inline glm::vec3 unpackTexel(uint32_t t) {
+    return glm::vec3{(float) (t & 0xff), (float) ((t >> 8) & 0xff), (float) ((t >> 16) & 0xff)} / 255.0f;
+}
+
+// Position of texel (x, y) of a level, within its tile and the tile in its row
+static inline uint32_t texelIndex(const TextureLevel& level, int x, int y) {
+    uint32_t tile = ((y / TEXTURE_TILE) * level.tiles_x) + (x / TEXTURE_TILE);
+    return level.offset + (tile * TEXTURE_TILE * TEXTURE_TILE) + ((y % TEXTURE_TILE) * TEXTURE_TILE) + (x % TEXTURE_TILE);
+}
+
+/* TEXTURE CLASS */
+Texture::Texture() : width(0), height(0) {}
+
+// Convert an image with 0 to 255 channels. Grey images are spread over red,
+// green and blue, and images without alpha are opaque.
+Texture::Texture(const cimg_library::CImg<float>& image, const std::string& file) : path(file), width(image.width()), height(image.height()) {
+    addLevel(width, height);
+    int channels = image.spectrum();
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float r = image(x, y, 0, 0);
+            float g = (channels > 1) ? image(x, y, 0, 1) : r;
+            float b = (channels > 2) ? image(x, y, 0, 2) : r;
+            float a = (channels > 3) ? image(x, y, 0, 3) : 255.0f;
+            texels[texelIndex(levels[0], x, y)] = packTexel(r, g, b, a);
+        }
+    }
+
+    buildMipmaps();
+}
+
+// The texture at a path, read and converted only if it has not been yet or
+// its file has changed since. Throws CImgException if it cannot be read.
+std::shared_ptr<Texture> Texture::load(const std::string& file) {
+    std::shared_ptr<Texture> texture = find(file);
+    if (texture == nullptr) {
+        texture = std::make_shared<Texture>(cimg_library::CImg<float>(file.c_str()), file);
+        share(texture);
+        #ifdef DEBUG
+        std::cout << "Converted " << file << " (" << texture->width << "x" << texture->height << ") to " << texture->levels.size()
+                  << " mip levels in " << texture->bytes() / 1024.0 << " KB" << std::endl;
+        #endif
+    }
+    return texture;
+}
+
+// The texture already read from a path, null if there is none or its file has changed
+std::shared_ptr<Texture> Texture::find(const std::string& file) {
+    auto entry = texture_library.find(file);
+    SceneSource current;
+    if (entry == texture_library.end() || !current.read(file) ||
+        current.size != entry->second.first.size || current.modified != entry->second.first.modified) {
+        return nullptr;
+    }
+    return entry->second.second;
+}
+
+// Offer a texture to later loads of its path
+void Texture::share(const std::shared_ptr<Texture>& texture) {
+    SceneSource source;
+    if (source.read(texture->path)) {
+        texture_library[texture->path] = std::make_pair(source, texture);
+    }
+}
+
+// Color at texture coordinates uv, from 0 to 1 across the image, blurred to
+// the mip level lod. Coordinates outside the image are clamped to its edge.
+glm::vec3 Texture::sample(glm::vec2 uv, float lod) const {
+    int last = levels.size() - 1;
+    if (!(lod > 0.0f)) {
+        return bilinear(levels[0], uv);
+    } else if (lod >= last) {
+        return bilinear(levels[last], uv);
+    }
+
+    int level = (int) lod;
+    return glm::mix(bilinear(levels[level], uv), bilinear(levels[level + 1], uv), lod - level);
+}
+
+size_t Texture::bytes() const {
+    return texels.size() * sizeof(uint32_t);
+}
+
+// True if each level is the size it says and lies within texels, for
+// textures read back from a compiled scene
+bool Texture::valid() const {
+    if (levels.empty() || levels[0].width != width || levels[0].height != height) {
+        return false;
+    }
+
+    for (auto &level : levels) {
+        int tiles_y = (level.height + TEXTURE_TILE - 1) / TEXTURE_TILE;
+        if (level.width <= 0 || level.height <= 0 || level.tiles_x != (level.width + TEXTURE_TILE - 1) / TEXTURE_TILE ||
+            level.offset > texels.size() || (size_t) level.tiles_x * tiles_y * TEXTURE_TILE * TEXTURE_TILE > texels.size() - level.offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t Texture::texel(const TextureLevel& level, int x, int y) const {
+    return texels[texelIndex(level, x, y)];
+}
+
+// Blend of the four texel centers around uv
+glm::vec3 Texture::bilinear(const TextureLevel& level, glm::vec2 uv) const {
+    float x = (uv.x * level.width) - 0.5f;
+    float y = (uv.y * level.height) - 0.5f;
+    float x_floor = std::floor(x);
+    float y_floor = std::floor(y);
+    float fx = x - x_floor;
+    float fy = y - y_floor;
+
+    int x0 = std::min(std::max((int) x_floor, 0), level.width - 1);
+    int y0 = std::min(std::max((int) y_floor, 0), level.height - 1);
+    int x1 = std::min(std::max((int) x_floor + 1, 0), level.width - 1);
+    int y1 = std::min(std::max((int) y_floor + 1, 0), level.height - 1);
+
+    glm::vec3 top = glm::mix(unpackTexel(texel(level, x0, y0)), unpackTexel(texel(level, x1, y0)), fx);
+    glm::vec3 bottom = glm::mix(unpackTexel(texel(level, x0, y1)), unpackTexel(texel(level, x1, y1)), fx);
+    return glm::mix(top, bottom, fy);
+}
+
+// Room for a w by h level after the last, in whole tiles
+void Texture::addLevel(int w, int h) {
+    TextureLevel level;
+    level.width = w;
+    level.height = h;
+    level.tiles_x = (w + TEXTURE_TILE - 1) / TEXTURE_TILE;
+    level.offset = texels.size();
+
+    int tiles_y = (h + TEXTURE_TILE - 1) / TEXTURE_TILE;
+    texels.resize(texels.size() + (level.tiles_x * tiles_y * TEXTURE_TILE * TEXTURE_TILE), 0);
+    levels.push_back(level);
+}
+
+// Halve the image level by level down to 1x1, each texel the average of the
+// 2x2 it covers in the level above. Odd edges repeat their last texel.
+void Texture::buildMipmaps() {
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        addLevel(std::max(levels.back().width / 2, 1), std::max(levels.back().height / 2, 1));
+        const TextureLevel &above = levels[levels.size() - 2];
+        const TextureLevel &level = levels.back();
+
+        for (int y = 0; y < level.height; y++) {
+            for (int x = 0; x < level.width; x++) {
+                uint32_t sum[4] = {2, 2, 2, 2}; // Rounds the average to nearest
+                for (int k = 0; k < 4; k++) {
+                    int ax = std::min((2 * x) + (k & 1), above.width - 1);
+                    int ay = std::min((2 * y) + (k >> 1), above.height - 1);
+                    uint32_t t = texel(above, ax, ay);
+                    for (int c = 0; c < 4; c++) {
+                        sum[c] += (t >> (8 * c)) & 0xff;
+                    }
+                }
+                texels[texelIndex(level, x, y)] = (sum[0] / 4) | ((sum[1] / 4) << 8) | ((sum[2] / 4) << 16) | ((sum[3] / 4) << 24);
+            }
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef __TEXTURE_HPP__
+#define __TEXTURE_HPP__
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include "CImg.h"
+#include "compiledscene.hpp"
+
+// Texels are stored in square tiles of this many along each side, so the
+// four texels of a bilinear lookup usually share one 64 byte cache line
+const int TEXTURE_TILE = 4;
+
+// One level of a mip pyramid, starting offset texels into the texture
+class TextureLevel {
+public:
+
+    int width, height;
+    int tiles_x; // Tiles along each row
+    uint32_t offset;
+
+};
+
+// An image converted for sampling: RGBA8 texels, interleaved, tiled, with a
+// box filtered mip pyramid down to 1x1. Lookups are bilinear within a level
+// and blend the two levels either side of the level of detail asked for.
+//
+// Textures are shared by path across every level loaded, and read again only
+// once their file changes.
+class Texture {
+public:
+
+    std::string path;
+    int width, height;
+    std::vector<TextureLevel> levels;
+    std::vector<uint32_t> texels; // All levels, largest first
+
+    Texture();
+    Texture(const cimg_library::CImg<float>& image, const std::string& file);
+
+    static std::shared_ptr<Texture> load(const std::string& file);
+    static std::shared_ptr<Texture> find(const std::string& file);
+    static void share(const std::shared_ptr<Texture>& texture);
+
+    glm::vec3 sample(glm::vec2 uv, float lod) const;
+    size_t bytes() const;
+    bool valid() const;
+
+private:
+
+    uint32_t texel(const TextureLevel& level, int x, int y) const;
+    glm::vec3 bilinear(const TextureLevel& level, glm::vec2 uv) const;
+    void addLevel(int w, int h);
+    void buildMipmaps();
+
+};
+
+#include "texture.cpp"
+
+#endif
@@ -0,0 +1,66 @@
+#include <algorithm>
+#include "traversalstats.hpp"
+
+#ifdef TRAVERSAL_STATS
+static thread_local TraversalStats traversal_stats;
+#endif
+
+/* TRAVERSAL STATS CLASS */
+TraversalStats::TraversalStats() : cells(0), box_tests(0), object_tests(0), triangle_tests(0), shadow_rays(0), secondary_rays(0), depth(0), max_depth(0) {}
+
+void TraversalStats::add(const TraversalStats& other) {
+    cells += other.cells;
+    box_tests += other.box_tests;
+    object_tests += other.object_tests;
+    triangle_tests += other.triangle_tests;
+    shadow_rays += other.shadow_rays;
+    secondary_rays += other.secondary_rays;
+    max_depth = std::max(max_depth, other.max_depth);
+}
+
+// Totals, and averages over every ray traced: camera, secondary and shadow
+void TraversalStats::print(std::ostream& out, long primary_rays) const {
+    double rays = std::max(primary_rays + secondary_rays + shadow_rays, 1L);
+    out << "Traversal: " << cells << " cells, " << box_tests << " box tests, " << object_tests << " object tests, "
+        << triangle_tests << " triangle tests" << std::endl;
+    out << "Per ray: " << cells / rays << " cells, " << box_tests / rays << " box tests, " << object_tests / rays << " object tests, "
+        << triangle_tests / rays << " triangle tests" << std::endl;
+    out << "Rays: " << primary_rays << " camera, " << secondary_rays << " secondary, " << shadow_rays << " shadow, max depth " << max_depth << std::endl;
+}
+
+void TraversalStats::writeJSON(std::ostream& out) const {
+    out << "{\"cells\": " << cells << ", \"box_tests\": " << box_tests << ", \"object_tests\": " << object_tests
+        << ", \"triangle_tests\": " << triangle_tests << ", \"shadow_rays\": " << shadow_rays << ", \"secondary_rays\": " << secondary_rays
+        << ", \"max_depth\": " << max_depth << "}";
+}
+
+// This thread's counts so far
+const TraversalStats& threadTraversalStats() {
+    #ifdef TRAVERSAL_STATS
+    return traversal_stats;
+    #else
+    static const TraversalStats none;
+    return none;
+    #endif
+}
+
+// This thread's counts since the last call, starting it again from zero
+TraversalStats takeTraversalStats() {
+    TraversalStats taken;
+    #ifdef TRAVERSAL_STATS
+    std::swap(taken, traversal_stats);
+    #endif
+    return taken;
+}
+
+#ifdef TRAVERSAL_STATS
+/* TRAVERSAL DEPTH CLASS */
+TraversalDepth::TraversalDepth() {
+    traversal_stats.depth++;
+    traversal_stats.max_depth = std::max(traversal_stats.max_depth, traversal_stats.depth);
+}
+
+TraversalDepth::~TraversalDepth() {
+    traversal_stats.depth--;
+}
+#endif
@@ -0,0 +1,56 @@
+#ifndef __TRAVERSALSTATS_HPP__
+#define __TRAVERSALSTATS_HPP__
+
+#include <ostream>
+
+// Work done tracing rays. Each thread counts into its own traversal_stats
+// while it renders, and render() sums them per frame. Counting is compiled
+// in only with -DTRAVERSAL_STATS, otherwise the COUNT_TRAVERSAL and
+// TRAVERSAL_DEPTH macros expand to nothing and every counter stays zero.
+class TraversalStats {
+public:
+
+    long cells; // Grid cells visited
+    long box_tests; // Grid bounds and BVH node slab tests, per ray of a packet
+    long object_tests; // Scene objects tested from grid cells and BVH leaves
+    long triangle_tests; // Model triangles tested, per ray of a packet
+    long shadow_rays; // Light visibility tests traced through the scene
+    long secondary_rays; // Reflected and refracted rays
+    int depth; // Reflections and refractions nested at the moment
+    int max_depth; // Most nested under one camera ray
+
+    TraversalStats();
+
+    void add(const TraversalStats& other);
+    void print(std::ostream& out, long primary_rays) const;
+    void writeJSON(std::ostream& out) const;
+
+};
+
+const TraversalStats& threadTraversalStats();
+TraversalStats takeTraversalStats();
+
+#ifdef TRAVERSAL_STATS
+
+// Counts a nested trace for as long as it is in scope
+class TraversalDepth {
+public:
+
+    TraversalDepth();
+    ~TraversalDepth();
+
+};
+
+#define COUNT_TRAVERSAL(counter, n) (traversal_stats.counter += (n))
+#define TRAVERSAL_DEPTH() TraversalDepth traversal_depth
+
+#else
+
+#define COUNT_TRAVERSAL(counter, n) ((void) 0)
+#define TRAVERSAL_DEPTH() ((void) 0)
+
+#endif
+
+#include "traversalstats.cpp"
+
+#endif
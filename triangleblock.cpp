@@ -0,0 +1,125 @@
+#include <glm/vec3.hpp>
+#include "triangleblock.hpp"
+
+// The kernel is written once over a vector of lanes: eight with AVX, four
+// otherwise, in which case a block takes two passes
+#ifdef __AVX__
+typedef __m256 lanes;
+const int LANE_COUNT = 8;
+static inline lanes lanesLoad(const float *p) { return _mm256_loadu_ps(p); }
+static inline lanes lanesSet(float f) { return _mm256_set1_ps(f); }
+static inline lanes lanesAdd(lanes a, lanes b) { return _mm256_add_ps(a, b); }
+static inline lanes lanesSub(lanes a, lanes b) { return _mm256_sub_ps(a, b); }
+static inline lanes lanesMul(lanes a, lanes b) { return _mm256_mul_ps(a, b); }
+static inline lanes lanesDiv(lanes a, lanes b) { return _mm256_div_ps(a, b); }
+static inline lanes lanesAnd(lanes a, lanes b) { return _mm256_and_ps(a, b); }
+static inline lanes lanesAbs(lanes a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+static inline lanes lanesGreaterEqual(lanes a, lanes b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+static inline lanes lanesLessEqual(lanes a, lanes b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+static inline lanes lanesLess(lanes a, lanes b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline int lanesMask(lanes a) { return _mm256_movemask_ps(a); }
+static inline void lanesStore(float *p, lanes a) { _mm256_storeu_ps(p, a); }
+#else
+typedef __m128 lanes;
+const int LANE_COUNT = 4;
+static inline lanes lanesLoad(const float *p) { return _mm_loadu_ps(p); }
+static inline lanes lanesSet(float f) { return _mm_set1_ps(f); }
+static inline lanes lanesAdd(lanes a, lanes b) { return _mm_add_ps(a, b); }
+static inline lanes lanesSub(lanes a, lanes b) { return _mm_sub_ps(a, b); }
+static inline lanes lanesMul(lanes a, lanes b) { return _mm_mul_ps(a, b); }
+static inline lanes lanesDiv(lanes a, lanes b) { return _mm_div_ps(a, b); }
+static inline lanes lanesAnd(lanes a, lanes b) { return _mm_and_ps(a, b); }
+static inline lanes lanesAbs(lanes a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+static inline lanes lanesGreaterEqual(lanes a, lanes b) { return _mm_cmpge_ps(a, b); }
+static inline lanes lanesLessEqual(lanes a, lanes b) { return _mm_cmple_ps(a, b); }
+static inline lanes lanesLess(lanes a, lanes b) { return _mm_cmplt_ps(a, b); }
+static inline int lanesMask(lanes a) { return _mm_movemask_ps(a); }
+static inline void lanesStore(float *p, lanes a) { _mm_storeu_ps(p, a); }
+#endif
+
+/* TRIANGLE BLOCK CLASS */
+// Empty lanes have zero length edges, so their determinant rejects every ray
+TriangleBlock::TriangleBlock() : count(0) {
+    for (int i = 0; i < TRIANGLE_BLOCK_SIZE; i++) {
+        v0x[i] = v0y[i] = v0z[i] = 0.0;
+        e1x[i] = e1y[i] = e1z[i] = 0.0;
+        e2x[i] = e2y[i] = e2z[i] = 0.0;
+        index[i] = -1;
+    }
+}
+
+void TriangleBlock::add(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, int i) {
+    glm::vec3 AB = v1 - v0;
+    glm::vec3 AC = v2 - v0;
+    v0x[count] = v0.x;
+    v0y[count] = v0.y;
+    v0z[count] = v0.z;
+    e1x[count] = AB.x;
+    e1y[count] = AB.y;
+    e1z[count] = AB.z;
+    e2x[count] = AC.x;
+    e2y[count] = AC.y;
+    e2z[count] = AC.z;
+    index[count] = i;
+    count++;
+}
+
+// Moller-Trumbore against every triangle of the block, keeping the nearest hit
+// in [0, t_max). Ties go to the earlier lane, as in a sequential loop.
+bool TriangleBlock::intersect(const glm::vec3& origin, const glm::vec3& dir, float t_max, BlockHit &hit) const {
+    lanes dx = lanesSet(dir.x), dy = lanesSet(dir.y), dz = lanesSet(dir.z);
+    lanes ox = lanesSet(origin.x), oy = lanesSet(origin.y), oz = lanesSet(origin.z);
+    lanes zero = lanesSet(0.0), one = lanesSet(1.0);
+
+    bool found = false;
+    hit.t = t_max;
+    COUNT_TRAVERSAL(triangle_tests, count);
+
+    for (int offset = 0; offset < count; offset += LANE_COUNT) {
+        lanes ab_x = lanesLoad(e1x + offset), ab_y = lanesLoad(e1y + offset), ab_z = lanesLoad(e1z + offset);
+        lanes ac_x = lanesLoad(e2x + offset), ac_y = lanesLoad(e2y + offset), ac_z = lanesLoad(e2z + offset);
+
+        lanes p_x = lanesSub(lanesMul(dy, ac_z), lanesMul(ac_y, dz));
+        lanes p_y = lanesSub(lanesMul(dz, ac_x), lanesMul(ac_z, dx));
+        lanes p_z = lanesSub(lanesMul(dx, ac_y), lanesMul(ac_x, dy));
+        lanes det = lanesAdd(lanesAdd(lanesMul(ab_x, p_x), lanesMul(ab_y, p_y)), lanesMul(ab_z, p_z));
+        lanes valid = lanesGreaterEqual(lanesAbs(det), lanesSet(0.0000001));
+        lanes inv_det = lanesDiv(one, det);
+
+        lanes t_x = lanesSub(ox, lanesLoad(v0x + offset));
+        lanes t_y = lanesSub(oy, lanesLoad(v0y + offset));
+        lanes t_z = lanesSub(oz, lanesLoad(v0z + offset));
+        lanes u = lanesMul(lanesAdd(lanesAdd(lanesMul(t_x, p_x), lanesMul(t_y, p_y)), lanesMul(t_z, p_z)), inv_det);
+        valid = lanesAnd(valid, lanesAnd(lanesGreaterEqual(u, zero), lanesLessEqual(u, one)));
+
+        lanes q_x = lanesSub(lanesMul(t_y, ab_z), lanesMul(ab_y, t_z));
+        lanes q_y = lanesSub(lanesMul(t_z, ab_x), lanesMul(ab_z, t_x));
+        lanes q_z = lanesSub(lanesMul(t_x, ab_y), lanesMul(ab_x, t_y));
+        lanes v = lanesMul(lanesAdd(lanesAdd(lanesMul(dx, q_x), lanesMul(dy, q_y)), lanesMul(dz, q_z)), inv_det);
+        valid = lanesAnd(valid, lanesAnd(lanesGreaterEqual(v, zero), lanesLessEqual(lanesAdd(u, v), one)));
+
+        lanes t = lanesMul(lanesAdd(lanesAdd(lanesMul(ac_x, q_x), lanesMul(ac_y, q_y)), lanesMul(ac_z, q_z)), inv_det);
+        valid = lanesAnd(valid, lanesAnd(lanesGreaterEqual(t, zero), lanesLess(t, lanesSet(hit.t))));
+
+        int mask = lanesMask(valid);
+        if (mask == 0) {
+            continue;
+        }
+
+        float lane_t[LANE_COUNT], lane_u[LANE_COUNT], lane_v[LANE_COUNT];
+        lanesStore(lane_t, t);
+        lanesStore(lane_u, u);
+        lanesStore(lane_v, v);
+        for (int l = 0; l < LANE_COUNT; l++) {
+            if ((mask & (1 << l)) && lane_t[l] < hit.t) {
+                hit.lane = offset + l;
+                hit.t = lane_t[l];
+                hit.u = lane_u[l];
+                hit.v = lane_v[l];
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
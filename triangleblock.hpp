@@ -0,0 +1,46 @@
+#ifndef __TRIANGLEBLOCK_HPP__
+#define __TRIANGLEBLOCK_HPP__
+
+#include <glm/vec3.hpp>
+#include "traversalstats.hpp"
+
+#ifdef __AVX__
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+
+// Triangles tested together by one call, padded with triangles that never hit
+const int TRIANGLE_BLOCK_SIZE = 8;
+
+class BlockHit {
+public:
+
+    int lane;
+    float t;
+    float u;
+    float v;
+
+};
+
+// Triangles stored one component per array, with precomputed edges, so a
+// whole block is tested against a ray with SIMD instructions
+class TriangleBlock {
+public:
+
+    float v0x[TRIANGLE_BLOCK_SIZE], v0y[TRIANGLE_BLOCK_SIZE], v0z[TRIANGLE_BLOCK_SIZE];
+    float e1x[TRIANGLE_BLOCK_SIZE], e1y[TRIANGLE_BLOCK_SIZE], e1z[TRIANGLE_BLOCK_SIZE];
+    float e2x[TRIANGLE_BLOCK_SIZE], e2y[TRIANGLE_BLOCK_SIZE], e2z[TRIANGLE_BLOCK_SIZE];
+    int index[TRIANGLE_BLOCK_SIZE]; // Owner's index of each triangle
+    int count;
+
+    TriangleBlock();
+
+    void add(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, int i);
+    bool intersect(const glm::vec3& origin, const glm::vec3& dir, float t_max, BlockHit &hit) const;
+
+};
+
+#include "triangleblock.cpp"
+
+#endif